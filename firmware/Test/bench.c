@@ -0,0 +1,29 @@
+#include "rpm_estimate.h"
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+/** Times estimateRpm() on the host, for a feel of how the changes to it compare */
+int main(void) {
+    const uint32_t sampleRateHz = 1488;
+    const int windows = 200000;
+    uint16_t samples[RPM_WINDOW];
+    uint32_t seed = 12345;
+    for (int i = 0; i < RPM_WINDOW; i++) {
+        seed = seed * 1103515245 + 12345;
+        samples[i] = (uint16_t) (8000. + 200. * sin(2 * M_PI * 160. * i / sampleRateHz) + (seed >> 16 & 0xFF));
+    }
+
+    struct timespec start, end;
+    uint32_t rpm = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < windows; i++) {
+        samples[i % RPM_WINDOW] ^= 1;
+        rpm += estimateRpm(samples, sampleRateHz);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / windows;
+    printf("%d-sample window, %d bins: %.0f ns per window, %u RPM\n", RPM_WINDOW, RPM_BINS, ns, rpm / windows);
+    return 0;
+}
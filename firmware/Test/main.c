@@ -1,5 +1,13 @@
+#include "dither.h"
 #include "logic.h"
+#include "logic_counts.h"
+#include "logic_fixed.h"
+#include "overcurrent.h"
+#include "rpm_estimate.h"
+#include "tach.h"
 #include "unity.h"
+#include <math.h>
+#include <stdio.h>
 
 void test_resistanceToTempC(void) {
     TEST_ASSERT_EQUAL_INT(25, resistanceToTempC(10000., &PTC_THERMISTOR_10K_3950));
@@ -150,6 +158,689 @@ void test_dcmBuckRatioToDutyCycle(void) {
     }
 }
 
+static double q16ToDouble(q16_t value) {
+    return value / 65536.0;
+}
+
+/** The Beta equation without resistanceToTempC's truncation to whole degrees */
+static double exactTempC(uint32_t counts, const PtcThermistorConfig *config) {
+    double ratio = fmax(1e-4, (counts & 0xfff) / 4096.0);
+    double ohms = ratioToUnknownBridgeResistance(ratio, REFERENCE_OHMS);
+    double invTempK = 1.0 / config->nominalTempK + log(ohms / config->nominalOhms) / config->beta;
+    return 1.0 / invTempK - KELVIN_OFFSET;
+}
+
+void test_tempTableAccuracy(void) {
+    // sweep every ADC reading; the accuracy for each table size is documented in temp_table.h
+    double maxErrorOperating = 0;
+    double maxErrorWide = 0;
+    for (uint32_t counts = 0; counts <= 0xfff; counts++) {
+        double expected = exactTempC(counts, &PTC_THERMISTOR_10K_3950);
+        double actual = q16ToDouble(tempCountsToCQ16(counts, TEMP_TABLE_10K_3950));
+        double error = fabs(expected - actual);
+        if (expected >= 0 && expected <= 100) { maxErrorOperating = fmax(maxErrorOperating, error); }
+        if (expected >= -40 && expected <= 150) { maxErrorWide = fmax(maxErrorWide, error); }
+    }
+    printf("temp table, %d steps/octave: max error %.3f C (0..100 C), %.3f C (-40..150 C)\n",
+           TEMP_TABLE_STEPS, maxErrorOperating, maxErrorWide);
+    TEST_ASSERT_LESS_OR_EQUAL_DOUBLE(0.3, maxErrorOperating);
+    TEST_ASSERT_LESS_OR_EQUAL_DOUBLE(0.6, maxErrorWide);
+}
+
+void test_fixedTempCountsToC(void) {
+    // neither path truncates to whole degrees, so they're within the table error everywhere
+    for (uint32_t counts = 0; counts <= 0xfff; counts++) {
+        double expected = tempCountsToC(counts, &PTC_THERMISTOR_10K_3950);
+        if (expected < -40 || expected > 150) { continue; }
+        double actual = q16ToDouble(tempCountsToCQ16(counts, TEMP_TABLE_10K_3950));
+        TEST_ASSERT_DOUBLE_WITHIN(0.6, expected, actual);
+    }
+
+    // out-of-bounds inputs are masked the same way as in-range ones
+    TEST_ASSERT_EQUAL_INT32(tempCountsToCQ16(0xfff, TEMP_TABLE_10K_3950),
+                            tempCountsToCQ16(UINT32_MAX, TEMP_TABLE_10K_3950));
+}
+
+void test_fixedDcmBuckRatioToDutyCycle(void) {
+    for (int i = 0; i <= 1000; i++) {
+        double expected = ratioToDcmBuckDutyCycle(i / 1000.0);
+        double actual = q16ToDouble(ratioToDcmBuckDutyCycleQ16(Q16(i / 1000.0)));
+        TEST_ASSERT_DOUBLE_WITHIN(2e-4, expected, actual);
+    }
+    TEST_ASSERT_EQUAL_INT32(0, ratioToDcmBuckDutyCycleQ16(-Q16_ONE));
+    TEST_ASSERT_EQUAL_INT32(Q16_ONE, ratioToDcmBuckDutyCycleQ16(2 * Q16_ONE));
+}
+
+/** The DCM buck model for any profile & PWM frequency, see ratioToDcmBuckDutyCycle */
+static double exactDcmTicksAt(double voltageRatio, double inputVoltage, double outputCurrent, double pwmFreqHz,
+                              double period) {
+    double k = 2.0 * DCM_INDUCTOR_VALUE * outputCurrent * pwmFreqHz / inputVoltage;
+    double dutyCycle = voltageRatio >= 1.0 ? 1.0 : fmin(1.0, sqrt(k * voltageRatio / (1.0 - voltageRatio)));
+    return dutyCycle * period;
+}
+
+static double exactDcmTicks(double voltageRatio, double inputVoltage, double outputCurrent) {
+    return exactDcmTicksAt(voltageRatio, inputVoltage, outputCurrent, PWM_FREQ_HZ, PWM_PERIOD);
+}
+
+void test_dutyTableAccuracy(void) {
+    static const struct {
+        const DutyTable *table;
+        double inputVoltage;
+        double outputCurrent;
+    } PROFILES[] = {
+        {&DUTY_TABLE_12V_100MA, 12.0, 0.1},
+        {&DUTY_TABLE_12V_200MA, 12.0, 0.2},
+        {&DUTY_TABLE_12V_300MA, 12.0, 0.3},
+        {&DUTY_TABLE_24V_100MA, 24.0, 0.1},
+        {&DUTY_TABLE_24V_200MA, 24.0, 0.2},
+        {&DUTY_TABLE_24V_300MA, 24.0, 0.3},
+    };
+
+    // sweep every Q16 ratio; the accuracy is documented in duty_table.h
+    for (size_t p = 0; p < sizeof(PROFILES) / sizeof(PROFILES[0]); p++) {
+        double maxError = 0;
+        for (q16_t ratio = 0; ratio <= Q16_ONE; ratio++) {
+            double expected = exactDcmTicks(q16ToDouble(ratio), PROFILES[p].inputVoltage,
+                                            PROFILES[p].outputCurrent);
+            double actual = ratioToDcmBuckTicksQ16(ratio, PROFILES[p].table);
+            maxError = fmax(maxError, fabs(expected - actual));
+        }
+        printf("duty table, %.0fV %.1fA: max error %.2f ticks\n", PROFILES[p].inputVoltage,
+               PROFILES[p].outputCurrent, maxError);
+        TEST_ASSERT_LESS_OR_EQUAL_DOUBLE(1.5, maxError);
+    }
+
+    // the default profile should match the double path, which truncates to whole ticks
+    for (int i = 0; i <= 1000; i++) {
+        double expected = (uint32_t) (ratioToDcmBuckDutyCycle(i / 1000.0) * PWM_PERIOD);
+        double actual = ratioToDcmBuckTicksQ16(Q16(i / 1000.0), &DUTY_TABLE_12V_200MA);
+        TEST_ASSERT_DOUBLE_WITHIN(2.0, expected, actual);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(0, ratioToDcmBuckTicksQ16(-Q16_ONE, &DUTY_TABLE_12V_200MA));
+    TEST_ASSERT_EQUAL_UINT32(PWM_PERIOD, ratioToDcmBuckTicksQ16(2 * Q16_ONE, &DUTY_TABLE_12V_200MA));
+}
+
+void test_dutyTableAtOtherFrequencies(void) {
+    // at the same frequency, the runtime table is the same as the compile-time one, give or take
+    // the rounding
+    static DutyTable table;
+    compileDutyTable(&DUTY_TABLE_12V_200MA, PWM_FREQ_HZ, PWM_PERIOD, &table);
+    TEST_ASSERT_EQUAL_INT32(DUTY_TABLE_12V_200MA.dcmK, table.dcmK);
+    TEST_ASSERT_INT32_WITHIN(1, DUTY_TABLE_12V_200MA.maxRatio, table.maxRatio);
+    for (int i = 0; i < DUTY_TABLE_KNOTS; i++) {
+        TEST_ASSERT_INT_WITHIN(1, DUTY_TABLE_12V_200MA.lower[i], table.lower[i]);
+        TEST_ASSERT_INT_WITHIN(1, DUTY_TABLE_12V_200MA.upper[i], table.upper[i]);
+    }
+
+    // and at other frequencies, it's as close to the model as the compile-time ones, relative to
+    // the period
+    static const int FREQS_HZ[] = {15000, 20000, 25000, 40000};
+    for (size_t f = 0; f < sizeof(FREQS_HZ) / sizeof(FREQS_HZ[0]); f++) {
+        uint32_t period = SYSCLOCK_FREQ_HZ / FREQS_HZ[f] - 1;
+        compileDutyTable(&DUTY_TABLE_12V_200MA, FREQS_HZ[f], period, &table);
+        double maxError = 0;
+        for (q16_t ratio = 0; ratio <= Q16_ONE; ratio++) {
+            double expected = exactDcmTicksAt(q16ToDouble(ratio), 12.0, 0.2, FREQS_HZ[f], period);
+            maxError = fmax(maxError, fabs(expected - ratioToDcmBuckTicksQ16(ratio, &table)));
+        }
+        printf("duty table at %dHz: max error %.2f of %u ticks\n", FREQS_HZ[f], maxError, period);
+        TEST_ASSERT_LESS_OR_EQUAL_DOUBLE(1.5 * (period + 1) / (PWM_PERIOD + 1) + 0.5, maxError);
+    }
+}
+
+void test_fixedFilterReadings(void) {
+    for (int i = 0; i < 150; i++) {
+        TEST_ASSERT_EQUAL_INT32(Q16(i), filterReadingsQ16(Q16(i), Q16(i)));
+    }
+
+    // step response should track the double filter closely over the whole settling time
+    double expected = 25.0;
+    q16_t actual = Q16(25.0);
+    for (int i = 0; i < 5000; i++) {
+        expected = filterReadings(65.0, expected);
+        actual = filterReadingsQ16(Q16(65.0), actual);
+        TEST_ASSERT_DOUBLE_WITHIN(0.01, expected, q16ToDouble(actual));
+    }
+}
+
+/** The fan curve of the count-domain tests, and TEST_CONFIG_Q16 is the same one */
+static const Config TEST_CONFIG = {
+    .fanMinDutyCycle = .04,
+    .fanMaxDutyCycle = 1.,
+    .fanSpinupDutyCycle = 1.,
+    .fanSpinupTimeMs = 200,
+    .tempMinC = 35,
+    .tempMaxC = 65,
+    .tempHysteresisC = 8,
+};
+static const ConfigQ16 TEST_CONFIG_Q16 = {
+    .fanMinDutyCycle = Q16(.04),
+    .fanMaxDutyCycle = Q16(1.),
+    .fanSpinupDutyCycle = Q16(1.),
+    .fanSpinupTimeMs = 200,
+    .tempMinC = Q16(35),
+    .tempMaxC = Q16(65),
+    .tempHysteresisC = Q16(8),
+};
+
+/** compileCountConfig for the board's thermistor & DUTY_TABLE_12V_200MA */
+static void compileTestCountConfig(const ConfigQ16 *configQ16, int tickFracBits, CountConfig *countConfig) {
+    compileCountConfig(configQ16, TEMP_TABLE_10K_3950, &DUTY_TABLE_12V_200MA, tickFracBits, countConfig);
+}
+
+void test_countDomainMatchesDouble(void) {
+    Config config = TEST_CONFIG;
+    static CountConfig countConfig;
+    compileTestCountConfig(&TEST_CONFIG_Q16, 0, &countConfig);
+
+    // every ADC sum, in every state, once the filters have settled. The double path gets the
+    // table temperature, since near 100% duty cycle a tenth of a degree is worth a few ticks, and
+    // test_tempTableAccuracy already covers how far that is from log().
+    static const enum ProcessState STATES[] = {FAN_OFF, FAN_SPINUP, FAN_ON};
+    double maxError = 0;
+    for (size_t s = 0; s < sizeof(STATES) / sizeof(STATES[0]); s++) {
+        for (int32_t sum = 0; sum < 4096 * ADC_NUM_SAMPLES; sum++) {
+            double tempC = q16ToDouble(tempSumToCQ16((uint32_t) sum, ADC_SAMPLE_BITS, TEMP_TABLE_10K_3950));
+
+            State state = {.state = STATES[s], .lastChangeTimeMs = 0, .lastFilteredTempC = tempC};
+            CountState countState = {
+                .state = STATES[s],
+                .lastChangeTimeMs = 0,
+                .filteredSum = sum << COUNT_FILTER_FRAC_BITS,
+            };
+            for (uint32_t ms = 100; ms <= 300; ms += 100) {
+                double ratio = fanVoltageRatio(tempC, ms, &config, &state);
+                double expected = ratioToDcmBuckDutyCycle(ratio) * PWM_PERIOD;
+                uint32_t actual = fanCompareValueCounts(sum, ms, &countConfig, &countState);
+                TEST_ASSERT_EQUAL(state.state, countState.state);
+                maxError = fmax(maxError, fabs(expected - actual));
+            }
+        }
+    }
+    printf("count domain: max error %.2f ticks\n", maxError);
+    TEST_ASSERT_LESS_OR_EQUAL_DOUBLE(1.0, maxError);
+}
+
+void test_countDomainNoStaircase(void) {
+    static CountConfig countConfig;
+    compileTestCountConfig(&TEST_CONFIG_Q16, 0, &countConfig);
+
+    // the full sum resolves hundredths of a degree, so walking the fan curve one ADC sum at a time
+    // should take many small steps, where whole degrees would take 30 large ones
+    uint32_t distinctValues = 0;
+    uint32_t maxStep = 0;
+    uint32_t lastValue = 0;
+    int32_t lastSum = countConfig.knotSums[countConfig.numKnots - 1];
+    for (int32_t sum = countConfig.onSum; sum <= lastSum; sum++) {
+        CountState countState = {.state = FAN_ON, .lastChangeTimeMs = 0, .filteredSum = sum << COUNT_FILTER_FRAC_BITS};
+        uint32_t value = fanCompareValueCounts(sum, 0, &countConfig, &countState);
+        if (sum > countConfig.onSum) {
+            TEST_ASSERT_GREATER_OR_EQUAL_UINT32(lastValue, value);
+            maxStep = value - lastValue > maxStep ? value - lastValue : maxStep;
+            distinctValues += value != lastValue;
+        }
+        lastValue = value;
+    }
+    printf("count domain: %u distinct compare values, max step %u ticks\n", distinctValues, maxStep);
+    TEST_ASSERT_GREATER_THAN_UINT32(10 * 30, distinctValues);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(2, maxStep);
+
+    // and the double path isn't stuck on whole degrees either
+    TEST_ASSERT_NOT_EQUAL(0, fmod(tempSumToC(200000, ADC_SAMPLE_BITS, &PTC_THERMISTOR_10K_3950), 1.0));
+}
+
+void test_ditheredCompareValues(void) {
+    // 4 fractional bits over 16 periods, from off to full duty: the periods add up to the exact
+    // value, and never differ by more than one tick
+    for (uint32_t fracTicks = 0; fracTicks <= (uint32_t) PWM_PERIOD << 4; fracTicks++) {
+        uint16_t periodTicks[16];
+        ditherCompareValue(fracTicks, 4, periodTicks);
+        uint32_t total = 0;
+        for (int i = 0; i < 16; i++) {
+            total += periodTicks[i];
+            TEST_ASSERT_UINT32_WITHIN(1, fracTicks >> 4, periodTicks[i]);
+        }
+        TEST_ASSERT_EQUAL_UINT32(fracTicks, total);
+    }
+
+    static CountConfig countConfig, fracCountConfig;
+    compileTestCountConfig(&TEST_CONFIG_Q16, 0, &countConfig);
+    compileTestCountConfig(&TEST_CONFIG_Q16, 4, &fracCountConfig);
+    TEST_ASSERT_EQUAL_UINT32(PWM_PERIOD << 4, fracCountConfig.maxTicks);
+
+    // the same fan curve, rounded to whole ticks, but with more steps in between
+    uint32_t distinctValues = 0;
+    uint32_t distinctFracValues = 0;
+    uint32_t lastValue = 0;
+    uint32_t lastFracValue = 0;
+    int32_t lastSum = countConfig.knotSums[countConfig.numKnots - 1];
+    for (int32_t sum = countConfig.onSum; sum <= lastSum; sum++) {
+        CountState countState = {.state = FAN_ON, .lastChangeTimeMs = 0, .filteredSum = sum << COUNT_FILTER_FRAC_BITS};
+        CountState fracCountState = countState;
+        uint32_t value = fanCompareValueCounts(sum, 0, &countConfig, &countState);
+        uint32_t fracValue = fanCompareValueCounts(sum, 0, &fracCountConfig, &fracCountState);
+        TEST_ASSERT_UINT32_WITHIN(8, value << 4, fracValue);
+        if (sum > countConfig.onSum) {
+            // rounding where the knots meet can take back a sixteenth of a tick
+            TEST_ASSERT_GREATER_OR_EQUAL_UINT32(lastFracValue, fracValue + 1);
+            distinctValues += value != lastValue;
+            distinctFracValues += fracValue != lastFracValue;
+        }
+        lastValue = value;
+        lastFracValue = fracValue;
+    }
+    printf("dithered count domain: %u distinct compare values, %u in whole ticks\n", distinctFracValues,
+           distinctValues);
+    TEST_ASSERT_GREATER_THAN_UINT32(4 * distinctValues, distinctFracValues);
+}
+
+void test_tempCToCounts(void) {
+    for (int tempC = 0; tempC <= 100; tempC++) {
+        uint32_t counts = tempCToCounts(tempC, &PTC_THERMISTOR_10K_3950);
+        TEST_ASSERT_TRUE(tempCountsToC(counts, &PTC_THERMISTOR_10K_3950) >= tempC);
+        TEST_ASSERT_TRUE(tempCountsToC(counts - 1, &PTC_THERMISTOR_10K_3950) < tempC);
+    }
+}
+
+void test_overTempSkipsFilter(void) {
+    Config config = TEST_CONFIG;
+    static CountConfig countConfig;
+    compileTestCountConfig(&TEST_CONFIG_Q16, 0, &countConfig);
+
+    // the watchdog threshold is the same reading in both paths, give or take the table error
+    TEST_ASSERT_UINT32_WITHIN(2, tempCToCounts(config.tempMaxC, &PTC_THERMISTOR_10K_3950),
+                              countConfig.overTempCounts);
+    TEST_ASSERT_EQUAL_UINT32(PWM_PERIOD, countConfig.maxTicks);
+
+    // a jump from 25C to 80C goes to full speed right away, and the filter picks up from there
+    State state = {.state = FAN_OFF, .lastChangeTimeMs = 0, .lastFilteredTempC = 25};
+    TEST_ASSERT_EQUAL_DOUBLE(1., fanVoltageRatioOverTemp(80, 0, &config, &state));
+    TEST_ASSERT_EQUAL(FAN_ON, state.state);
+    TEST_ASSERT_EQUAL_DOUBLE(1., fanVoltageRatio(64, 10, &config, &state));
+
+    int32_t hotSum = (int32_t) tempCToCounts(80, &PTC_THERMISTOR_10K_3950) << ADC_SAMPLE_BITS;
+    CountState countState = {
+        .state = FAN_OFF,
+        .lastChangeTimeMs = 0,
+        .filteredSum = tempCToAdcSum(Q16(25), TEMP_TABLE_10K_3950) << COUNT_FILTER_FRAC_BITS,
+    };
+    TEST_ASSERT_EQUAL_UINT32(PWM_PERIOD, fanCompareValueOverTemp(hotSum, 0, &countConfig, &countState));
+    TEST_ASSERT_EQUAL(FAN_ON, countState.state);
+    TEST_ASSERT_EQUAL_UINT32(PWM_PERIOD, fanCompareValueCounts(hotSum, 10, &countConfig, &countState));
+}
+
+void test_heldReadingMatchesEveryPeriod(void) {
+    Config config = TEST_CONFIG;
+    static CountConfig countConfig;
+    compileTestCountConfig(&TEST_CONFIG_Q16, 0, &countConfig);
+
+    // one reading every 51 periods, like after STOP mode, ends up where one every period does
+    State everyPeriod = {.state = FAN_OFF, .lastChangeTimeMs = 0, .lastFilteredTempC = 25};
+    State held = everyPeriod;
+    int32_t sum = (int32_t) tempCToCounts(40, &PTC_THERMISTOR_10K_3950) << ADC_SAMPLE_BITS;
+    CountState countsEveryPeriod = {
+        .state = FAN_OFF,
+        .lastChangeTimeMs = 0,
+        .filteredSum = tempCToAdcSum(Q16(25), TEMP_TABLE_10K_3950) << COUNT_FILTER_FRAC_BITS,
+    };
+    CountState countsHeld = countsEveryPeriod;
+    for (uint32_t ms = 0; ms < 60000; ms += 510) {
+        for (uint32_t i = 0; i < 51; i++) {
+            fanVoltageRatio(40, ms, &config, &everyPeriod);
+            fanCompareValueCounts(sum, ms, &countConfig, &countsEveryPeriod);
+        }
+        fanVoltageRatioHeld(40, 510, ms, &config, &held);
+        fanCompareValueCountsHeld(sum, 510, ms, &countConfig, &countsHeld);
+        TEST_ASSERT_EQUAL(everyPeriod.state, held.state);
+        TEST_ASSERT_DOUBLE_WITHIN(1e-9, everyPeriod.lastFilteredTempC, held.lastFilteredTempC);
+        TEST_ASSERT_EQUAL(countsEveryPeriod.state, countsHeld.state);
+        // the 100Hz filter stalls a bit short of its input from rounding every step, by a fraction
+        // of a sum
+        TEST_ASSERT_INT32_WITHIN(1 << (COUNT_FILTER_FRAC_BITS - 2), countsEveryPeriod.filteredSum,
+                                 countsHeld.filteredSum);
+    }
+    // and 40C is past tempMinC, so both turned the fan on
+    TEST_ASSERT_EQUAL(FAN_ON, held.state);
+    TEST_ASSERT_EQUAL(FAN_ON, countsHeld.state);
+}
+
+void test_adaptiveControlPeriod(void) {
+    Config config = TEST_CONFIG;
+    static CountConfig countConfig;
+    compileTestCountConfig(&TEST_CONFIG_Q16, 0, &countConfig);
+
+    // steady temperature: back off to CONTROL_PERIOD_MAX_MS
+    State state = {.state = FAN_ON, .lastChangeTimeMs = 0, .lastFilteredTempC = 50};
+    int32_t sum = tempCToAdcSum(Q16(50), TEMP_TABLE_10K_3950);
+    CountState countState = {.state = FAN_ON, .lastChangeTimeMs = 0, .filteredSum = sum << COUNT_FILTER_FRAC_BITS};
+    uint32_t periodMs = CONTROL_PERIOD_MIN_MS;
+    uint32_t countsPeriodMs = CONTROL_PERIOD_MIN_MS;
+    uint32_t ms = 0;
+    for (int i = 0; i < 10; i++) {
+        fanVoltageRatioHeld(50, periodMs, ms += periodMs, &config, &state);
+        periodMs = nextControlPeriodMs(50, periodMs, &state);
+        fanCompareValueCountsHeld(sum, countsPeriodMs, ms, &countConfig, &countState);
+        countsPeriodMs = nextControlPeriodMsCounts(sum, countsPeriodMs, &countConfig, &countState);
+    }
+    TEST_ASSERT_EQUAL_UINT32(CONTROL_PERIOD_MAX_MS, periodMs);
+    TEST_ASSERT_EQUAL_UINT32(CONTROL_PERIOD_MAX_MS, countsPeriodMs);
+
+    // a degree's jump goes right back to the fastest rate
+    int32_t hotterSum = tempCToAdcSum(Q16(51), TEMP_TABLE_10K_3950);
+    fanVoltageRatioHeld(51, periodMs, ms += periodMs, &config, &state);
+    fanCompareValueCountsHeld(hotterSum, countsPeriodMs, ms, &countConfig, &countState);
+    TEST_ASSERT_EQUAL_UINT32(CONTROL_PERIOD_MIN_MS, nextControlPeriodMs(51, periodMs, &state));
+    TEST_ASSERT_EQUAL_UINT32(CONTROL_PERIOD_MIN_MS,
+                             nextControlPeriodMsCounts(hotterSum, countsPeriodMs, &countConfig, &countState));
+
+    // and the filter follows a step the same way at 1.5Hz as at 100Hz
+    double fast = 25;
+    double slow = 25;
+    for (uint32_t t = 0; t < 64; t++) {
+        for (int i = 0; i < 64; i++) { fast = filterReadingsElapsed(50, fast, 10); }
+        slow = filterReadingsElapsed(50, slow, 640);
+        TEST_ASSERT_DOUBLE_WITHIN(1e-6, fast, slow);
+    }
+}
+
+void test_overcurrentRetry(void) {
+    OvercurrentState state = {0};
+    TEST_ASSERT_EQUAL(OVERCURRENT_RUN, overcurrentStep(0, 1000, &state));
+
+    // a stalled fan trips right after every retry, which come further and further apart
+    uint32_t trips = 0;
+    uint32_t ms = 1000;
+    for (uint32_t retry = 0; retry < OVERCURRENT_MAX_RETRIES; retry++) {
+        uint32_t delayMs = OVERCURRENT_RETRY_MS << retry;
+        TEST_ASSERT_EQUAL(OVERCURRENT_WAIT, overcurrentStep(++trips, ms, &state));
+        TEST_ASSERT_EQUAL(OVERCURRENT_WAIT, overcurrentStep(trips, ms + delayMs - 1, &state));
+        TEST_ASSERT_EQUAL(OVERCURRENT_RETRY, overcurrentStep(trips, ms + delayMs, &state));
+        TEST_ASSERT_EQUAL(OVERCURRENT_RUN, overcurrentStep(trips, ms + delayMs + 10, &state));
+        ms += delayMs + 20;
+    }
+    // until it gives up for good
+    TEST_ASSERT_EQUAL(OVERCURRENT_LOCKED_OUT, overcurrentStep(++trips, ms, &state));
+    TEST_ASSERT_EQUAL(OVERCURRENT_LOCKED_OUT, overcurrentStep(trips, ms + 1000000, &state));
+
+    // while a trip long after the last one starts over at the shortest delay
+    state = (OvercurrentState){0};
+    TEST_ASSERT_EQUAL(OVERCURRENT_WAIT, overcurrentStep(1, 1000, &state));
+    TEST_ASSERT_EQUAL(OVERCURRENT_RETRY, overcurrentStep(1, 1000 + OVERCURRENT_RETRY_MS, &state));
+    ms = 1000 + OVERCURRENT_RETRY_MS + OVERCURRENT_CLEAR_MS;
+    TEST_ASSERT_EQUAL(OVERCURRENT_WAIT, overcurrentStep(2, ms, &state));
+    TEST_ASSERT_EQUAL(OVERCURRENT_RETRY, overcurrentStep(2, ms + OVERCURRENT_RETRY_MS, &state));
+    TEST_ASSERT_EQUAL_UINT32(1, state.tripsInRow);
+}
+
+/** A window of decimated FAN_SENSE sums: DC, commutation ripple at rpm, a second harmonic and noise */
+static void rippleWindow(double rpm, double amplitude, double noise, uint32_t sampleRateHz, uint16_t *samples) {
+    double rippleHz = rpm * RPM_RIPPLE_PER_REV / 60.;
+    uint32_t seed = 12345;
+    for (int i = 0; i < RPM_WINDOW; i++) {
+        seed = seed * 1103515245 + 12345;
+        double t = (double) i / sampleRateHz;
+        double value = 8000. + amplitude * sin(2 * M_PI * rippleHz * t + 1.) +
+                       amplitude / 3 * sin(4 * M_PI * rippleHz * t) + noise * ((seed >> 16 & 0x7FFF) / 16384. - 1.);
+        samples[i] = (uint16_t) lround(value);
+    }
+}
+
+void test_rpmEstimate(void) {
+    uint16_t samples[RPM_WINDOW];
+    uint32_t sampleRateHz = 1488;
+
+    // across the range, within a tenth of a bin
+    double binRpm = (double) sampleRateHz / RPM_WINDOW * 60 / RPM_RIPPLE_PER_REV;
+    for (double rpm = 3 * binRpm; rpm < (RPM_BINS - 1) * binRpm; rpm += binRpm / 7) {
+        rippleWindow(rpm, 200., 50., sampleRateHz, samples);
+        TEST_ASSERT_DOUBLE_WITHIN(binRpm / 10, rpm, estimateRpm(samples, sampleRateHz));
+    }
+
+    // and a fifth at the bottom, where the window's own leakage around DC gets in
+    rippleWindow(2 * binRpm, 200., 50., sampleRateHz, samples);
+    TEST_ASSERT_DOUBLE_WITHIN(binRpm / 5, 2 * binRpm, estimateRpm(samples, sampleRateHz));
+
+    // and closer than that on a bin
+    rippleWindow(8 * binRpm, 200., 50., sampleRateHz, samples);
+    TEST_ASSERT_DOUBLE_WITHIN(binRpm / 20, 8 * binRpm, estimateRpm(samples, sampleRateHz));
+
+    // the full 16 bits of a sum of 16 samples don't overflow
+    rippleWindow(3000., 30000., 0., sampleRateHz, samples);
+    for (int i = 0; i < RPM_WINDOW; i++) { samples[i] += 24000; }
+    TEST_ASSERT_DOUBLE_WITHIN(binRpm / 10, 3000., estimateRpm(samples, sampleRateHz));
+
+    // noise alone, or a flat line, is no speed at all
+    rippleWindow(3000., 0., 200., sampleRateHz, samples);
+    TEST_ASSERT_EQUAL_UINT32(0, estimateRpm(samples, sampleRateHz));
+    rippleWindow(3000., 0., 0., sampleRateHz, samples);
+    TEST_ASSERT_EQUAL_UINT32(0, estimateRpm(samples, sampleRateHz));
+}
+
+void test_tachRpm(void) {
+    static TachEdges edges;
+    TachState state = {0};
+    const uint32_t ticksPerSecond = 12000000;
+    // 1500 RPM is 50 pulses per second, and the timestamps wrap around at 24 bits along the way
+    const uint32_t period = ticksPerSecond / 50;
+    uint32_t ticks = TACH_TICKS_MASK - 3 * period;
+    uint32_t ms = 1000;
+    TEST_ASSERT_EQUAL_UINT32(0, tachRpm(&edges, ms, ticksPerSecond, &state));
+
+    // nothing until there are enough periods for the median
+    for (int i = 0; i < TACH_PERIODS + 1; i++) {
+        TEST_ASSERT_EQUAL_UINT32(0, tachRpm(&edges, ms, ticksPerSecond, &state));
+        addTachEdge(ticks += period, &edges);
+        ms += 20;
+    }
+    TEST_ASSERT_EQUAL_UINT32(1500, tachRpm(&edges, ms, ticksPerSecond, &state));
+
+    // a spurious edge, or a missed one, doesn't move it
+    addTachEdge(ticks + period / 3, &edges);
+    addTachEdge(ticks += period, &edges);
+    addTachEdge(ticks += 2 * period, &edges);
+    addTachEdge(ticks += period, &edges);
+    TEST_ASSERT_UINT32_WITHIN(1, 1500, tachRpm(&edges, ms += 80, ticksPerSecond, &state));
+
+    // and a slower fan is slower
+    for (int i = 0; i < TACH_PERIODS; i++) { addTachEdge(ticks += 2 * period, &edges); }
+    TEST_ASSERT_EQUAL_UINT32(750, tachRpm(&edges, ms += 280, ticksPerSecond, &state));
+
+    // no edges for TACH_TIMEOUT_MS is a stopped fan, and the time it was stopped for isn't a period
+    TEST_ASSERT_EQUAL_UINT32(750, tachRpm(&edges, ms + TACH_TIMEOUT_MS - 1, ticksPerSecond, &state));
+    TEST_ASSERT_EQUAL_UINT32(0, tachRpm(&edges, ms += TACH_TIMEOUT_MS, ticksPerSecond, &state));
+    ticks += ticksPerSecond;
+    for (int i = 0; i < TACH_PERIODS; i++) {
+        addTachEdge(ticks += period, &edges);
+        TEST_ASSERT_EQUAL_UINT32(0, tachRpm(&edges, ms += 20, ticksPerSecond, &state));
+    }
+    addTachEdge(ticks += period, &edges);
+    TEST_ASSERT_EQUAL_UINT32(1500, tachRpm(&edges, ms += 20, ticksPerSecond, &state));
+}
+
+void test_switchedTach(void) {
+    const uint32_t ticksPerSecond = 12000000;
+    const uint32_t holdoffTicks = TACH_HOLDOFF_US * (ticksPerSecond / 1000000);
+    // 1500 RPM, under a 30kHz PWM output that switches the fan's ground
+    const uint32_t tachPeriod = ticksPerSecond / 50;
+    const uint32_t pwmPeriod = 400;
+    // TIM1's input filter only passes a level that holds for 8 core clocks
+    const uint32_t filterTicks = 8;
+    // down to 2.5% duty cycle, an on-time just past the filter
+    const uint32_t onTicks[] = {filterTicks + 2, 40, 200, 380, 400};
+    for (uint32_t d = 0; d < sizeof(onTicks) / sizeof(onTicks[0]); d++) {
+        static TachEdges edges;
+        edges = (TachEdges){0};
+        TachState state = {0};
+        uint32_t lowTicks = 0;
+        for (uint32_t ticks = 1; ticks < (TACH_PERIODS + 2) * tachPeriod; ticks++) {
+            // the pin only follows the tach while the output is on, the pull-up holds it high otherwise
+            int tachHigh = (ticks + tachPeriod / 3) % tachPeriod < tachPeriod / 2;
+            int high = ticks % pwmPeriod >= onTicks[d] || tachHigh;
+            lowTicks = high ? 0 : lowTicks + 1;
+            if (lowTicks == filterTicks) { captureTachEdge(ticks, holdoffTicks, &edges); }
+        }
+        // one edge per tach pulse, so the speed comes out right at any duty cycle
+        TEST_ASSERT_EQUAL_UINT32(TACH_PERIODS + 2, edges.edges);
+        TEST_ASSERT_UINT32_WITHIN(3, 1500, tachRpm(&edges, 0, ticksPerSecond, &state));
+    }
+}
+
+void test_minSpeedAndStall(void) {
+    Config config = {
+        .fanSpinupDutyCycle = 1.,
+        .fanSpinupTimeMs = 1000,
+        .fanMinRpm = 600,
+        .fanStallTimeMs = 2000,
+        .tempMinC = 30,
+        .tempMaxC = 80,
+        .tempHysteresisC = 5,
+        .fanMinDutyCycle = .3,
+        .fanMaxDutyCycle = 1.,
+    };
+    State state = {.state = FAN_ON, .lastChangeTimeMs = 0, .lastFilteredTempC = 35, .rpm = 1000};
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .37, fanVoltageRatio(35, 10, &config, &state));
+
+    // too slow, so the voltage goes up on top of the curve
+    state.rpm = 400;
+    uint32_t ms = 10;
+    for (int i = 0; i < 100; i++) { fanVoltageRatio(35, ms += 10, &config, &state); }
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .37 + 1000 * MIN_SPEED_BOOST_PER_MS, fanVoltageRatio(35, ms, &config, &state));
+
+    // holds just above fanMinRpm, and comes back down once it's well above it
+    state.rpm = 650;
+    for (int i = 0; i < 100; i++) { fanVoltageRatio(35, ms += 10, &config, &state); }
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .37 + 1000 * MIN_SPEED_BOOST_PER_MS, fanVoltageRatio(35, ms, &config, &state));
+    state.rpm = 700;
+    for (int i = 0; i < 100; i++) { fanVoltageRatio(35, ms += 10, &config, &state); }
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .37 + 750 * MIN_SPEED_BOOST_PER_MS, fanVoltageRatio(35, ms, &config, &state));
+
+    // stopped for fanStallTimeMs gets the spinup kick again, and again after that if it's still stuck
+    state.rpm = 0;
+    uint32_t stallMs = ms;
+    while (ms - stallMs < 1990) {
+        fanVoltageRatio(35, ms += 10, &config, &state);
+        TEST_ASSERT_EQUAL(FAN_ON, state.state);
+    }
+    TEST_ASSERT_EQUAL_DOUBLE(1., fanVoltageRatio(35, ms += 10, &config, &state));
+    TEST_ASSERT_EQUAL(FAN_SPINUP, state.state);
+    TEST_ASSERT_EQUAL_UINT32(1, state.stalls);
+    fanVoltageRatio(35, ms += 1000, &config, &state);
+    TEST_ASSERT_EQUAL(FAN_ON, state.state);
+    fanVoltageRatio(35, ms += 2000, &config, &state);
+    TEST_ASSERT_EQUAL_UINT32(2, state.stalls);
+
+    // the count domain does the same
+    ConfigQ16 configQ16 = TEST_CONFIG_Q16;
+    configQ16.fanMinRpm = 600;
+    configQ16.fanStallTimeMs = 2000;
+    static CountConfig countConfig;
+    compileTestCountConfig(&configQ16, 4, &countConfig);
+    int32_t sum = tempCToAdcSum(Q16(50), TEMP_TABLE_10K_3950);
+    CountState countState = {.state = FAN_ON, .filteredSum = sum << COUNT_FILTER_FRAC_BITS, .rpm = 400};
+    ms = 0;
+    for (int i = 0; i < 100; i++) { fanCompareValueCounts(sum, ms += 10, &countConfig, &countState); }
+    TEST_ASSERT_INT32_WITHIN(Q16(.002), Q16(.52) + 1000 * MIN_SPEED_BOOST_Q16_PER_MS, countState.targetRatio);
+    countState.rpm = 0;
+    stallMs = ms;
+    while (ms - stallMs < 2000) { fanCompareValueCounts(sum, ms += 10, &countConfig, &countState); }
+    TEST_ASSERT_EQUAL(FAN_SPINUP, countState.state);
+    TEST_ASSERT_EQUAL_UINT32(1, countState.stalls);
+}
+
+void test_hostPwmPolicy(void) {
+    Config config = {
+        .fanSpinupDutyCycle = 1.,
+        .fanSpinupTimeMs = 100,
+        .tempMinC = 30,
+        .tempMaxC = 80,
+        .tempHysteresisC = 5,
+        .fanMinDutyCycle = .3,
+        .fanMaxDutyCycle = 1.,
+        .hostPwmPolicy = HOST_PWM_IGNORE,
+    };
+    State state = {.state = FAN_ON, .lastFilteredTempC = 35, .hostRatio = .8};
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .37, fanVoltageRatio(35, 10, &config, &state));
+
+    // the higher of the two, and never under fanMinDutyCycle
+    config.hostPwmPolicy = HOST_PWM_MAX;
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .8, fanVoltageRatio(35, 20, &config, &state));
+    state.hostRatio = .1;
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .37, fanVoltageRatio(35, 30, &config, &state));
+    // the host alone keeps the fan on when it's cold, and it starts with the spinup kick
+    state.lastFilteredTempC = 20;
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .3, fanVoltageRatio(20, 40, &config, &state));
+    state.hostRatio = 0;
+    TEST_ASSERT_EQUAL_DOUBLE(0, fanVoltageRatio(20, 50, &config, &state));
+    TEST_ASSERT_EQUAL(FAN_OFF, state.state);
+    state.hostRatio = .5;
+    TEST_ASSERT_EQUAL_DOUBLE(1., fanVoltageRatio(20, 60, &config, &state));
+    TEST_ASSERT_EQUAL(FAN_SPINUP, state.state);
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .5, fanVoltageRatio(20, 160, &config, &state));
+
+    // only the host, even when it's warm
+    config.hostPwmPolicy = HOST_PWM_OVERRIDE;
+    state.lastFilteredTempC = 60;
+    TEST_ASSERT_DOUBLE_WITHIN(.001, .5, fanVoltageRatio(60, 170, &config, &state));
+    state.hostRatio = 0;
+    TEST_ASSERT_EQUAL_DOUBLE(0, fanVoltageRatio(60, 180, &config, &state));
+    TEST_ASSERT_EQUAL(FAN_OFF, state.state);
+
+    // the count domain does the same
+    ConfigQ16 configQ16 = TEST_CONFIG_Q16;
+    configQ16.fanSpinupTimeMs = 100;
+    configQ16.hostPwmPolicy = HOST_PWM_MAX;
+    static CountConfig countConfig;
+    compileTestCountConfig(&configQ16, 4, &countConfig);
+    int32_t warmSum = tempCToAdcSum(Q16(50), TEMP_TABLE_10K_3950);
+    int32_t coldSum = tempCToAdcSum(Q16(20), TEMP_TABLE_10K_3950);
+    CountState countState = {.state = FAN_ON, .filteredSum = warmSum << COUNT_FILTER_FRAC_BITS, .hostRatio = Q16(.8)};
+    fanCompareValueCounts(warmSum, 10, &countConfig, &countState);
+    TEST_ASSERT_INT32_WITHIN(Q16(.001), Q16(.8), countState.targetRatio);
+    countState.hostRatio = Q16(.1);
+    fanCompareValueCounts(warmSum, 20, &countConfig, &countState);
+    TEST_ASSERT_INT32_WITHIN(Q16(.001), Q16(.52), countState.targetRatio);
+
+    countConfig.hostPwmPolicy = HOST_PWM_OVERRIDE;
+    fanCompareValueCounts(warmSum, 30, &countConfig, &countState);
+    TEST_ASSERT_INT32_WITHIN(Q16(.001), Q16(.1), countState.targetRatio);
+    countState.hostRatio = 0;
+    TEST_ASSERT_EQUAL_UINT32(0, fanCompareValueCounts(warmSum, 40, &countConfig, &countState));
+    TEST_ASSERT_EQUAL(FAN_OFF, countState.state);
+
+    countConfig.hostPwmPolicy = HOST_PWM_IGNORE;
+    countState = (CountState){.state = FAN_OFF, .filteredSum = coldSum << COUNT_FILTER_FRAC_BITS, .hostRatio = Q16(1)};
+    TEST_ASSERT_EQUAL_UINT32(0, fanCompareValueCounts(coldSum, 50, &countConfig, &countState));
+}
+
+void test_tachOutput(void) {
+    const TachModel model = {.maxRpm = 3000, .stopRatioQ16 = Q16(.2)};
+    TEST_ASSERT_EQUAL_UINT32(0, modelRpm(0, &model));
+    TEST_ASSERT_EQUAL_UINT32(0, modelRpm(Q16(.2), &model));
+    TEST_ASSERT_EQUAL_UINT32(1500, modelRpm(Q16(.6), &model));
+    TEST_ASSERT_EQUAL_UINT32(3000, modelRpm(Q16(1), &model));
+    TEST_ASSERT_EQUAL_UINT32(3000, modelRpm(Q16(1.5), &model));
+
+    // 1500 RPM is 50 pulses, so 100 toggles, per second
+    const uint32_t ticksPerSecond = 12000000;
+    TEST_ASSERT_EQUAL_UINT32(0, tachHalfPeriodTicks(0, ticksPerSecond));
+    TEST_ASSERT_EQUAL_UINT32(ticksPerSecond / 100, tachHalfPeriodTicks(1500, ticksPerSecond));
+    // and the toggles of a barely turning fan are as far apart as SysTick goes
+    TEST_ASSERT_EQUAL_UINT32(TACH_TICKS_MASK, tachHalfPeriodTicks(1, ticksPerSecond));
+
+    // what the host measures from that matches what the tach input would
+    static TachEdges edges;
+    TachState state = {0};
+    uint32_t ticks = 0;
+    uint32_t ms = 0;
+    for (int i = 0; i < TACH_PERIODS + 1; i++) {
+        addTachEdge(ticks += 2 * tachHalfPeriodTicks(2400, ticksPerSecond), &edges);
+        tachRpm(&edges, ms += 25, ticksPerSecond, &state);
+    }
+    TEST_ASSERT_EQUAL_UINT32(2400, tachRpm(&edges, ms, ticksPerSecond, &state));
+}
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_resistanceToTempC);
@@ -160,6 +851,26 @@ int main(void) {
     RUN_TEST(test_tempCountsToC);
     RUN_TEST(test_spuriousReading);
     RUN_TEST(test_dcmBuckRatioToDutyCycle);
+    RUN_TEST(test_tempTableAccuracy);
+    RUN_TEST(test_fixedTempCountsToC);
+    RUN_TEST(test_fixedDcmBuckRatioToDutyCycle);
+    RUN_TEST(test_dutyTableAccuracy);
+    RUN_TEST(test_dutyTableAtOtherFrequencies);
+    RUN_TEST(test_fixedFilterReadings);
+    RUN_TEST(test_countDomainMatchesDouble);
+    RUN_TEST(test_countDomainNoStaircase);
+    RUN_TEST(test_ditheredCompareValues);
+    RUN_TEST(test_tempCToCounts);
+    RUN_TEST(test_overTempSkipsFilter);
+    RUN_TEST(test_heldReadingMatchesEveryPeriod);
+    RUN_TEST(test_adaptiveControlPeriod);
+    RUN_TEST(test_overcurrentRetry);
+    RUN_TEST(test_rpmEstimate);
+    RUN_TEST(test_tachRpm);
+    RUN_TEST(test_switchedTach);
+    RUN_TEST(test_minSpeedAndStall);
+    RUN_TEST(test_hostPwmPolicy);
+    RUN_TEST(test_tachOutput);
     return UNITY_END();
 }
 
@@ -1,4 +1,4 @@
-#include "py32f0xx.h"
+#include "peripherals.h"
 #include <sys/cdefs.h>
 
 #pragma ide diagnostic ignored "bugprone-reserved-identifier"
@@ -23,11 +23,20 @@ int _kill(int pid, int sig) { return 0; }
 
 int __errno;
 
+#ifdef USE_HAL_DRIVER
 void HAL_MspInit(void) {
 }
 
 void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim) {
 }
+#endif
+
+void checkOk(int ok) {
+    if (ok != STATUS_OK) {
+        __asm__("bkpt #0");
+        while (1) { __NOP(); }
+    }
+}
 
 _Noreturn void __assert_func(const char *file, int line, const char *func, const char *failedexpr) {
     // if we have a debugger attached, break into it, otherwise the watchdog will reset us
@@ -0,0 +1,11 @@
+#include "dither.h"
+
+void ditherCompareValue(uint32_t fracTicks, int fracBits, uint16_t *periodTicks) {
+    uint32_t fracMask = (1u << fracBits) - 1;
+    uint32_t error = 0;
+    for (uint32_t period = 0; period <= fracMask; period++) {
+        error += fracTicks;
+        periodTicks[period] = (uint16_t) (error >> fracBits);
+        error &= fracMask;
+    }
+}
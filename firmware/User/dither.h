@@ -0,0 +1,13 @@
+#ifndef FIRMWARE_DITHER_H
+#define FIRMWARE_DITHER_H
+
+#include "stdint.h"
+
+/**
+ * Spreads a compare value with fracBits fractional bits over 2**fracBits PWM periods, as whole ticks
+ * that add up to it exactly. It's a first-order sigma-delta, so the extra ticks are evenly spaced.
+ */
+void ditherCompareValue(uint32_t fracTicks, int fracBits, uint16_t *periodTicks);
+
+
+#endif//FIRMWARE_DITHER_H
@@ -0,0 +1,9 @@
+#include "duty_table.h"
+
+// must match DCM_INDUCTOR_VALUE, PWM_FREQ_HZ and PWM_PERIOD, test_dutyTableAccuracy checks that it does
+const DutyTable DUTY_TABLE_12V_100MA = DUTY_TABLE_DCM(12.0, 47e-6, 0.1, 30000, 399);
+const DutyTable DUTY_TABLE_12V_200MA = DUTY_TABLE_DCM(12.0, 47e-6, 0.2, 30000, 399);
+const DutyTable DUTY_TABLE_12V_300MA = DUTY_TABLE_DCM(12.0, 47e-6, 0.3, 30000, 399);
+const DutyTable DUTY_TABLE_24V_100MA = DUTY_TABLE_DCM(24.0, 47e-6, 0.1, 30000, 399);
+const DutyTable DUTY_TABLE_24V_200MA = DUTY_TABLE_DCM(24.0, 47e-6, 0.2, 30000, 399);
+const DutyTable DUTY_TABLE_24V_300MA = DUTY_TABLE_DCM(24.0, 47e-6, 0.3, 30000, 399);
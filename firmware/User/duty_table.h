@@ -0,0 +1,112 @@
+#ifndef FIRMWARE_DUTY_TABLE_H
+#define FIRMWARE_DUTY_TABLE_H
+
+#include "logic.h"
+#include "stdint.h"
+
+/**
+ * Compile-time tables mapping the output:input voltage ratio (Q16.16) straight to the TIM1
+ * compare value, so that the firmware doesn't need the sqrt() in ratioToDcmBuckDutyCycle or a
+ * multiply by PWM_PERIOD at runtime.
+ *
+ * The duty cycle goes like sqrt(r) near r = 0, and shoots up to 100% right before r = 1, so
+ * evenly spaced knots are way off at both ends. Instead, the table has two halves: one for
+ * x = r, and one for x = maxRatio - r, where maxRatio is the ratio at which the duty cycle reaches
+ * 100%. Like temp_table.h, every octave of x gets DUTY_TABLE_STEPS evenly spaced knots, down to
+ * x = 1/2048, and readings in between knots are linearly interpolated. The knots keep
+ * DUTY_TABLE_FRAC_BITS fractional bits of a tick, so that only the result gets rounded.
+ *
+ * That's 2 * 65 uint16_t knots, so each table costs 272 bytes of flash, and is within 0.7 ticks of
+ * ratioToDcmBuckDutyCycle(r) * PWM_PERIOD for all the profiles below from x = 1/2048 up, which
+ * leaves the count-domain path room to stay within a tick. Below that, sqrt(r) is steep enough to
+ * be about a tick off (see test_dutyTableAccuracy).
+ */
+#define DUTY_TABLE_STEPS 8
+#define DUTY_TABLE_STEP_BITS 3
+#define DUTY_TABLE_GROUPS 8
+
+/** Fractional bits of the knots, so a period can be up to 4095 ticks */
+#define DUTY_TABLE_FRAC_BITS 4
+
+/** x = 0 .. 0.5 is covered by DUTY_TABLE_GROUPS groups of knots, plus one for x = 0.5 */
+#define DUTY_TABLE_KNOTS (DUTY_TABLE_GROUPS * DUTY_TABLE_STEPS + 1)
+
+/** The first group of knots is spaced 2**DUTY_TABLE_UNIT_BITS apart, in Q16.16 */
+#define DUTY_TABLE_UNIT_BITS 5
+
+typedef struct {
+    /** DUTY_TABLE_DCM_K (Q16.16) at pwmFreqHz, so that compileDutyTable can redo it at another one */
+    int32_t dcmK;
+    int32_t pwmFreqHz;
+    /** Voltage ratio (Q16.16) at which the duty cycle reaches 100% */
+    int32_t maxRatio;
+    /** Timer ticks at r = x, with DUTY_TABLE_FRAC_BITS fractional bits */
+    uint16_t lower[DUTY_TABLE_KNOTS];
+    /** Timer ticks at r = maxRatio - x, with DUTY_TABLE_FRAC_BITS fractional bits */
+    uint16_t upper[DUTY_TABLE_KNOTS];
+} DutyTable;
+
+/** x (Q16.16) at knot i, see TEMP_TABLE_X */
+#define DUTY_TABLE_X(i) ((double) DUTY_TABLE_X_Q16(i))
+#define DUTY_TABLE_X_Q16(i)                                                       \
+    (((i) < DUTY_TABLE_STEPS ? (i)                                                \
+                             : (DUTY_TABLE_STEPS + ((i) & (DUTY_TABLE_STEPS - 1))) \
+                                   << (((i) >> DUTY_TABLE_STEP_BITS) - 1))          \
+     << DUTY_TABLE_UNIT_BITS)
+
+/**
+ * 2 * L * Io / (Vi * T) of the DCM buck model, so that the duty cycle is sqrt(K * r / (1 - r)).
+ * See ratioToDcmBuckDutyCycle.
+ */
+#define DUTY_TABLE_DCM_K(inputVoltage, inductorValue, outputCurrent, pwmFreqHz) \
+    (2.0 * (inductorValue) * (outputCurrent) * (pwmFreqHz) / (inputVoltage))
+
+/** Timer ticks for voltage ratio r (Q16.16), with DUTY_TABLE_FRAC_BITS, rounded and clamped to 100% */
+#define DUTY_TABLE_DCM_TICKS(r, k, period)                                                        \
+    ((uint16_t) ((k) * (r) >= 65536.0 - (r)                                                       \
+                     ? (period) << DUTY_TABLE_FRAC_BITS                                           \
+                     : __builtin_sqrt((k) * (r) / (65536.0 - (r))) * ((period) << DUTY_TABLE_FRAC_BITS) + 0.5))
+
+/** maxRatio for the DCM buck model, 1 / (1 + K) in Q16.16 */
+#define DUTY_TABLE_DCM_MAX_RATIO(k) ((int32_t) (65536.0 / (1.0 + (k)) + 0.5))
+
+#define DUTY_TABLE_REPEAT_1(f, i, k, p) f(i, k, p),
+#define DUTY_TABLE_REPEAT_2(f, i, k, p) DUTY_TABLE_REPEAT_1(f, i, k, p) DUTY_TABLE_REPEAT_1(f, (i) + 1, k, p)
+#define DUTY_TABLE_REPEAT_4(f, i, k, p) DUTY_TABLE_REPEAT_2(f, i, k, p) DUTY_TABLE_REPEAT_2(f, (i) + 2, k, p)
+#define DUTY_TABLE_REPEAT_8(f, i, k, p) DUTY_TABLE_REPEAT_4(f, i, k, p) DUTY_TABLE_REPEAT_4(f, (i) + 4, k, p)
+#define DUTY_TABLE_REPEAT_16(f, i, k, p) DUTY_TABLE_REPEAT_8(f, i, k, p) DUTY_TABLE_REPEAT_8(f, (i) + 8, k, p)
+#define DUTY_TABLE_REPEAT_32(f, i, k, p) DUTY_TABLE_REPEAT_16(f, i, k, p) DUTY_TABLE_REPEAT_16(f, (i) + 16, k, p)
+#define DUTY_TABLE_REPEAT_64(f, i, k, p) DUTY_TABLE_REPEAT_32(f, i, k, p) DUTY_TABLE_REPEAT_32(f, (i) + 32, k, p)
+
+#define DUTY_TABLE_LOWER_KNOT(i, k, period) DUTY_TABLE_DCM_TICKS(DUTY_TABLE_X(i), k, period)
+#define DUTY_TABLE_UPPER_KNOT(i, k, period) \
+    DUTY_TABLE_DCM_TICKS(DUTY_TABLE_DCM_MAX_RATIO(k) - DUTY_TABLE_X(i), k, period)
+
+/**
+ * Expands to the initializer of a DutyTable for the DCM buck model. The parameters must be
+ * literals so that the compiler can fold the whole table into flash, and period is the number of
+ * timer ticks at 100% duty cycle.
+ */
+#define DUTY_TABLE_DCM(inputVoltage, inductorValue, outputCurrent, pwmFreqHz, period)                   \
+    DUTY_TABLE_DCM_(DUTY_TABLE_DCM_K(inputVoltage, inductorValue, outputCurrent, pwmFreqHz), pwmFreqHz, period)
+#define DUTY_TABLE_DCM_(k, freqHz, period)                                             \
+    {                                                                                  \
+        .dcmK = (int32_t) ((k) * 65536.0 + 0.5),                                       \
+        .pwmFreqHz = (freqHz),                                                         \
+        .maxRatio = DUTY_TABLE_DCM_MAX_RATIO(k),                                       \
+        .lower = {DUTY_TABLE_REPEAT_64(DUTY_TABLE_LOWER_KNOT, 0, k, period)            \
+                      DUTY_TABLE_LOWER_KNOT(DUTY_TABLE_KNOTS - 1, k, period)},         \
+        .upper = {DUTY_TABLE_REPEAT_64(DUTY_TABLE_UPPER_KNOT, 0, k, period)            \
+                      DUTY_TABLE_UPPER_KNOT(DUTY_TABLE_KNOTS - 1, k, period)},         \
+    }
+
+/** Input voltage/fan load profiles, all with the 47uH inductor at PWM_FREQ_HZ */
+extern const DutyTable DUTY_TABLE_12V_100MA;
+extern const DutyTable DUTY_TABLE_12V_200MA;
+extern const DutyTable DUTY_TABLE_12V_300MA;
+extern const DutyTable DUTY_TABLE_24V_100MA;
+extern const DutyTable DUTY_TABLE_24V_200MA;
+extern const DutyTable DUTY_TABLE_24V_300MA;
+
+
+#endif//FIRMWARE_DUTY_TABLE_H
@@ -0,0 +1,44 @@
+#include "fan_policy.h"
+
+uint32_t msSinceLast(uint32_t currentMs, uint32_t aMs, uint32_t bMs) {
+    uint32_t sinceA = currentMs - aMs;
+    uint32_t sinceB = currentMs - bMs;
+    return sinceA < sinceB ? sinceA : sinceB;
+}
+
+int fanStalled(uint32_t rpm, uint32_t fanMinRpm, uint32_t fanStallTimeMs, uint32_t currentMs,
+               uint32_t lastChangeTimeMs, uint32_t *lastTurningMs) {
+    if (fanMinRpm == 0) { return 0; }
+    if (rpm > 0) {
+        *lastTurningMs = currentMs;
+        return 0;
+    }
+    return msSinceLast(currentMs, *lastTurningMs, lastChangeTimeMs) >= fanStallTimeMs;
+}
+
+int32_t minSpeedBoostSteps(uint32_t rpm, uint32_t fanMinRpm, uint32_t currentMs, uint32_t lastChangeTimeMs,
+                           uint32_t *lastSpeedCheckMs) {
+    if (fanMinRpm == 0) { return 0; }
+    uint32_t elapsedMs = msSinceLast(currentMs, *lastSpeedCheckMs, lastChangeTimeMs);
+    *lastSpeedCheckMs = currentMs;
+    // longer than that, and the fan was off anyway
+    if (elapsedMs > CONTROL_PERIOD_MAX_MS) { elapsedMs = CONTROL_PERIOD_MAX_MS; }
+    if (rpm < fanMinRpm) {
+        return (int32_t) elapsedMs * 4;
+    } else if (rpm >= fanMinRpm + fanMinRpm / 8) {
+        return -(int32_t) elapsedMs;
+    }
+    return 0;
+}
+
+int hostWantsFan(enum HostPwmPolicy hostPwmPolicy, int hostRatioAboveZero) {
+    return hostPwmPolicy != HOST_PWM_IGNORE && hostRatioAboveZero;
+}
+
+int tempWantsFan(enum HostPwmPolicy hostPwmPolicy, int aboveThreshold) {
+    return hostPwmPolicy != HOST_PWM_OVERRIDE && aboveThreshold;
+}
+
+int hostRatioWins(enum HostPwmPolicy hostPwmPolicy, int hostRatioAbove) {
+    return hostPwmPolicy == HOST_PWM_OVERRIDE || hostRatioAbove;
+}
@@ -0,0 +1,45 @@
+#ifndef FIRMWARE_FAN_POLICY_H
+#define FIRMWARE_FAN_POLICY_H
+
+#include "logic.h"
+#include "stdint.h"
+
+/**
+ * The decisions that fanVoltageRatio & fanCompareValueCounts share: whether the host or the
+ * thermistor want the fan on, whether the fan stalled, and which way the boost towards fanMinRpm
+ * goes. Each of them keeps its own voltage ratios, in double or in Q16, and passes in the fields of
+ * its state that these work on.
+ */
+
+/** Time since the later of two timestamps, so since whatever happened last */
+uint32_t msSinceLast(uint32_t currentMs, uint32_t aMs, uint32_t bMs);
+
+/**
+ * Whether the fan has been at 0 RPM for fanStallTimeMs, since it last turned or changed state
+ *
+ * @param lastTurningMs set to currentMs while the fan turns
+ */
+int fanStalled(uint32_t rpm, uint32_t fanMinRpm, uint32_t fanStallTimeMs, uint32_t currentMs,
+               uint32_t lastChangeTimeMs, uint32_t *lastTurningMs);
+
+/**
+ * How far to move the boost on top of the fan curve since the last check, in quarters of
+ * MIN_SPEED_BOOST_PER_MS: up while the fan is slower than fanMinRpm, and back down at a quarter of
+ * that once it's 1/8 faster. 0 without fanMinRpm.
+ *
+ * @param lastSpeedCheckMs set to currentMs
+ */
+int32_t minSpeedBoostSteps(uint32_t rpm, uint32_t fanMinRpm, uint32_t currentMs, uint32_t lastChangeTimeMs,
+                           uint32_t *lastSpeedCheckMs);
+
+/** Whether the host wants the fan on, as far as hostPwmPolicy lets it */
+int hostWantsFan(enum HostPwmPolicy hostPwmPolicy, int hostRatioAboveZero);
+
+/** Whether the thermistor wants the fan on, as far as hostPwmPolicy lets it */
+int tempWantsFan(enum HostPwmPolicy hostPwmPolicy, int aboveThreshold);
+
+/** Whether the host's voltage ratio replaces the fan curve's, for any hostPwmPolicy but HOST_PWM_IGNORE */
+int hostRatioWins(enum HostPwmPolicy hostPwmPolicy, int hostRatioAbove);
+
+
+#endif//FIRMWARE_FAN_POLICY_H
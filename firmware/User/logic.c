@@ -1,4 +1,5 @@
 #include "logic.h"
+#include "fan_policy.h"
 #include <assert.h>
 #include <math.h>
 
@@ -8,8 +9,6 @@ double countsToRatio(uint32_t counts) {
     return clampedResult;
 }
 
-static const double REFERENCE_OHMS = 100000.0;
-
 /**
  * @param voltageRatio ratio of the voltage to full-scale. For example, 0.5 for 2.5V on a 5V scale.
  * @param knownResistance the resistance of the R2 resistor in the voltage divider (ohms)
@@ -36,26 +35,41 @@ double resistanceToTempC(double thermistorOhms, const PtcThermistorConfig *confi
     // https://en.wikipedia.org/wiki/Thermistor#B_or_%CE%B2_parameter_equation
     double invTempK = (1.0 / nominalTempK) +
                       (1.0 / beta) * log(thermistorOhms / nominalOhms);
-    return (int) ((1.0 / invTempK) - ((double) KELVIN_OFFSET));
+    return (1.0 / invTempK) - ((double) KELVIN_OFFSET);
 }
 
-double tempCountsToC(uint32_t tempCounts, const PtcThermistorConfig *config) {
-    double voltageRatio = countsToRatio(tempCounts);
+double tempSumToC(uint32_t tempSum, int sampleBits, const PtcThermistorConfig *config) {
+    // same as countsToRatio, but keeping the extra bits from adding up the samples
+    double result = (tempSum & ((0x1000u << sampleBits) - 1)) / (double) (0x1000u << sampleBits);
+    double voltageRatio = fmin(1.0, fmax(1e-4, result));
     double thermistorOhms = ratioToUnknownBridgeResistance(voltageRatio, REFERENCE_OHMS);
     return resistanceToTempC(thermistorOhms, config);
 }
 
+double tempCountsToC(uint32_t tempCounts, const PtcThermistorConfig *config) {
+    return tempSumToC(tempCounts, 0, config);
+}
+
+static const double PI = 3.14159265358979323846;
+static const double SAMPLING_RATE_HZ = 100.0;
+static const double CUTOFF_FREQ_HZ = 0.1;
+
 /**
  * Low-pass filter to eliminate noise & jitter in the temperature readings.
  */
 double filterReadings(double newValue, double oldValue) {
-    static const double PI = 3.14159265358979323846;
-    static const double SAMPLING_RATE_HZ = 100.0;
-    static const double CUTOFF_FREQ_HZ = 0.1;
     const double ALPHA = 1.0 - (1.0 / (1.0 + tan(PI * CUTOFF_FREQ_HZ / SAMPLING_RATE_HZ)));
     return ALPHA * newValue + (1.0 - ALPHA) * oldValue;
 }
 
+double filterReadingsElapsed(double newValue, double oldValue, uint32_t elapsedMs) {
+    // filterReadings keeps this much of the old value every sample, so it's the same filter as
+    // getting the same reading every 1 / SAMPLING_RATE_HZ
+    const double RETENTION = 1.0 / (1.0 + tan(PI * CUTOFF_FREQ_HZ / SAMPLING_RATE_HZ));
+    double alpha = 1.0 - pow(RETENTION, elapsedMs * SAMPLING_RATE_HZ / 1000.0);
+    return alpha * newValue + (1.0 - alpha) * oldValue;
+}
+
 double clampd(double value, double min, double max) {
     if (value < min) {
         return min;
@@ -65,6 +79,14 @@ double clampd(double value, double min, double max) {
     return value;
 }
 
+uint32_t tempCToCounts(double tempC, const PtcThermistorConfig *config) {
+    // resistanceToTempC and ratioToUnknownBridgeResistance, solved for the ratio
+    double invTempK = 1.0 / (tempC + (double) KELVIN_OFFSET) - 1.0 / (double) config->nominalTempK;
+    double thermistorOhms = config->nominalOhms * exp(config->beta * invTempK);
+    double voltageRatio = REFERENCE_OHMS / (thermistorOhms + REFERENCE_OHMS);
+    return (uint32_t) clampd(ceil(voltageRatio * 4096.0), 1.0, 4095.0);
+}
+
 /** Linear interpolation between two points */
 double interpolate(double x, double x0, double x1, double y0, double y1) {
     double xClamped = clampd(x, x0, x1);
@@ -91,11 +113,14 @@ void transitionState(State *state, enum ProcessState newState, uint32_t currentM
  * We use 12V & 0.2A as the default parameters, since this is the most common use case.
  */
 double ratioToDcmBuckDutyCycle(double voltageRatio) {
-    static const double INPUT_VOLTAGE = 12.0;
-    static const double INDUCTOR_VALUE = 47e-6;
-    static const double OUTPUT_CURRENT = 0.2;
-    static const double SWITCHING_FREQUENCY = PWM_FREQ_HZ;
-    static const double SWITCHING_PERIOD = 1.0 / SWITCHING_FREQUENCY;
+    return ratioToDcmBuckDutyCycleAt(voltageRatio, PWM_FREQ_HZ);
+}
+
+double ratioToDcmBuckDutyCycleAt(double voltageRatio, double switchingFrequency) {
+    static const double INPUT_VOLTAGE = DCM_INPUT_VOLTAGE;
+    static const double INDUCTOR_VALUE = DCM_INDUCTOR_VALUE;
+    static const double OUTPUT_CURRENT = DCM_OUTPUT_CURRENT;
+    const double SWITCHING_PERIOD = 1.0 / switchingFrequency;
 
     voltageRatio = clampd(voltageRatio, 0.0, 1.0);
 
@@ -111,17 +136,29 @@ double ratioToDcmBuckDutyCycle(double voltageRatio) {
     return clampd(duty, 0.0, 1.0);
 }
 
-/**
- * Gets the output:input voltage ratio, based on the new temperature reading.
- *
- * Different from the duty cycle because we effectively have a buck converter acting in
- * DCM (discontinuous conduction mode), and the math there is a bit more complicated.
- */
-double fanVoltageRatio(double newTempC, uint32_t currentMs, const Config *config, State *state) {
-    double tempC = state->lastFilteredTempC = filterReadings(newTempC, state->lastFilteredTempC);
+/** Adds minSpeedBoost to the fan curve's voltage ratio, after moving it towards fanMinRpm */
+static double boostToMinSpeed(double ratio, uint32_t currentMs, const Config *config, State *state) {
+    if (config->fanMinRpm == 0) { return ratio; }
+    int32_t steps = minSpeedBoostSteps(state->rpm, config->fanMinRpm, currentMs, state->lastChangeTimeMs,
+                                       &state->lastSpeedCheckMs);
+    state->minSpeedBoost += steps * MIN_SPEED_BOOST_PER_MS / 4;
+    state->minSpeedBoost = clampd(state->minSpeedBoost, 0.0, config->fanMaxDutyCycle);
+    return fmin(ratio + state->minSpeedBoost, config->fanMaxDutyCycle);
+}
+
+/** Combines the fan curve's voltage ratio with the host's, for hostPwmPolicy */
+static double combineHostRatio(double ratio, const Config *config, const State *state) {
+    if (config->hostPwmPolicy == HOST_PWM_IGNORE) { return ratio; }
+    if (hostRatioWins(config->hostPwmPolicy, state->hostRatio > ratio)) { ratio = state->hostRatio; }
+    return clampd(ratio, config->fanMinDutyCycle, config->fanMaxDutyCycle);
+}
+
+/** fanVoltageRatio, once tempC has been filtered */
+static double fanVoltageRatioFiltered(double tempC, uint32_t currentMs, const Config *config, State *state) {
     switch (state->state) {
         case FAN_OFF: {
-            if (tempC >= config->tempMinC) {
+            if (tempWantsFan(config->hostPwmPolicy, tempC >= config->tempMinC) ||
+                hostWantsFan(config->hostPwmPolicy, state->hostRatio > 0)) {
                 // fan should be turned on
                 transitionState(state, FAN_SPINUP, currentMs);
                 // fall-through
@@ -146,17 +183,64 @@ double fanVoltageRatio(double newTempC, uint32_t currentMs, const Config *config
         }
         case FAN_ON:
         fan_on: {
-            if (tempC < (config->tempMinC - config->tempHysteresisC)) {
+            int tempOn = tempWantsFan(config->hostPwmPolicy, tempC >= config->tempMinC - config->tempHysteresisC);
+            if (!tempOn && !hostWantsFan(config->hostPwmPolicy, state->hostRatio > 0)) {
                 // fan should be turned off
                 transitionState(state, FAN_OFF, currentMs);
                 return 0.0;
+            } else if (fanStalled(state->rpm, config->fanMinRpm, config->fanStallTimeMs, currentMs,
+                                  state->lastChangeTimeMs, &state->lastTurningMs)) {
+                // the tach says it's not turning, so give it the spinup kick again
+                state->stalls++;
+                transitionState(state, FAN_SPINUP, currentMs);
+                return config->fanSpinupDutyCycle;
             } else {
                 // interpolate between the min and max duty cycles based on the current temperature
-                return interpolate(tempC, config->tempMinC, config->tempMaxC,
-                                   config->fanMinDutyCycle, config->fanMaxDutyCycle);
+                double ratio = tempOn ? interpolate(tempC, config->tempMinC, config->tempMaxC,
+                                                    config->fanMinDutyCycle, config->fanMaxDutyCycle)
+                                      : config->fanMinDutyCycle;
+                ratio = combineHostRatio(ratio, config, state);
+                return boostToMinSpeed(ratio, currentMs, config, state);
             }
         }
         default:
             assert(0);
     }
 }
+
+/**
+ * Gets the output:input voltage ratio, based on the new temperature reading.
+ *
+ * Different from the duty cycle because we effectively have a buck converter acting in
+ * DCM (discontinuous conduction mode), and the math there is a bit more complicated.
+ */
+double fanVoltageRatio(double newTempC, uint32_t currentMs, const Config *config, State *state) {
+    state->lastFilteredTempC = filterReadings(newTempC, state->lastFilteredTempC);
+    return fanVoltageRatioFiltered(state->lastFilteredTempC, currentMs, config, state);
+}
+
+double fanVoltageRatioHeld(double newTempC, uint32_t elapsedMs, uint32_t currentMs, const Config *config,
+                           State *state) {
+    state->lastFilteredTempC = filterReadingsElapsed(newTempC, state->lastFilteredTempC, elapsedMs);
+    return fanVoltageRatioFiltered(state->lastFilteredTempC, currentMs, config, state);
+}
+
+uint32_t nextControlPeriodMs(double newTempC, uint32_t lastPeriodMs, const State *state) {
+    /** Readings this close to the filtered temperature mean nothing much is happening */
+    static const double STEADY_TEMP_C = 0.25;
+
+    if (state->state == FAN_SPINUP || fabs(newTempC - state->lastFilteredTempC) >= STEADY_TEMP_C) {
+        return CONTROL_PERIOD_MIN_MS;
+    }
+    uint32_t periodMs = 2 * lastPeriodMs;
+    return periodMs < CONTROL_PERIOD_MAX_MS ? periodMs : CONTROL_PERIOD_MAX_MS;
+}
+
+double fanVoltageRatioOverTemp(double newTempC, uint32_t currentMs, const Config *config, State *state) {
+    state->lastFilteredTempC = newTempC;
+    if (state->state != FAN_ON) {
+        // full speed spins the fan up just as well
+        transitionState(state, FAN_ON, currentMs);
+    }
+    return config->fanMaxDutyCycle;
+}
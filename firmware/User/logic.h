@@ -3,7 +3,36 @@
 
 #include "stdint.h"
 
+static const int SYSCLOCK_FREQ_HZ = (int) 12e6;
+/** The default PWM frequency, main.c's setPwmFrequency can change it at runtime */
 static const int PWM_FREQ_HZ = 30000;
+/** TIM1 auto-reload value at PWM_FREQ_HZ, so the compare value for 100% duty cycle */
+static const int PWM_PERIOD = (SYSCLOCK_FREQ_HZ / PWM_FREQ_HZ) - 1;
+/**
+ * How many samples of each ADC channel readAdc adds up. Samples synchronized to the PWM don't see
+ * the switching ripple, so they need a lot less averaging.
+ */
+#ifndef ADC_SAMPLE_BITS
+#ifdef ADC_PWM_SYNC
+#define ADC_SAMPLE_BITS 4
+#else
+#define ADC_SAMPLE_BITS 6
+#endif
+#endif
+#define ADC_NUM_SAMPLES (1 << ADC_SAMPLE_BITS)
+
+/**
+ * Shortest & longest time between control iterations, see nextControlPeriodMs. The longest one
+ * has to leave room for the 1s IWDG timeout.
+ */
+static const uint32_t CONTROL_PERIOD_MIN_MS = 10;
+static const uint32_t CONTROL_PERIOD_MAX_MS = 640;
+
+/**
+ * How fast fanMinRpm raises the voltage ratio while the fan is too slow. It comes back down at a
+ * quarter of that, once the fan is 1/8 faster than fanMinRpm.
+ */
+static const double MIN_SPEED_BOOST_PER_MS = 1. / 4096;
 
 enum ProcessState {
     FAN_OFF,
@@ -11,6 +40,16 @@ enum ProcessState {
     FAN_ON,
 };
 
+/** How a PWM signal from a 4-wire fan header combines with the fan curve */
+enum HostPwmPolicy {
+    /** Only the thermistor counts, the host's duty cycle is ignored */
+    HOST_PWM_IGNORE,
+    /** Whichever of the two asks for the higher voltage */
+    HOST_PWM_MAX,
+    /** Only the host's duty cycle counts, except that the ADC watchdog still goes to full speed */
+    HOST_PWM_OVERRIDE,
+};
+
 /**
  * Based upon the "Trapezoid Control Algorithm" in https://www.mattmillman.com/projects/another-intelligent-4-wire-fan-speed-controller/
  */
@@ -39,7 +78,17 @@ typedef struct {
      * How long does it take the fan to spin up and overcome stiction? In my testing,
      * it takes about 50ms for the to move the first fan-blade-length.
      */
-    int fanSpinupTimeMs;
+    uint32_t fanSpinupTimeMs;
+    /**
+     * With a tach wire, what is the slowest the fan should turn while it is on? 0 without one.
+     *
+     * Below it, the voltage goes up bit by bit on top of the fan curve, until the fan is back
+     * above it. The fan curve's minimum duty cycle may be enough for a new fan, but not for one
+     * with worn bearings.
+     */
+    uint32_t fanMinRpm;
+    /** How long can the fan sit at 0 RPM while it is on, before it gets spun up again? */
+    uint32_t fanStallTimeMs;
 
     /** What is the minimum temperature that the fan should be allowed to run at? */
     double tempMinC;
@@ -53,12 +102,29 @@ typedef struct {
      * The goal of this variable is to avoid turning the fan on and off repeatedly
      */
     double tempHysteresisC;
+
+    /** What to make of State.hostRatio, with a host PWM signal */
+    enum HostPwmPolicy hostPwmPolicy;
 } Config;
 
 typedef struct {
     enum ProcessState state;
     uint32_t lastChangeTimeMs;
     double lastFilteredTempC;
+    /** Fan speed from the tach, for fanMinRpm. The caller keeps it up to date, 0 when stopped. */
+    uint32_t rpm;
+    /** Voltage ratio on top of the fan curve, to keep the fan at fanMinRpm */
+    double minSpeedBoost;
+    /** Last time the fan was seen turning, and that minSpeedBoost was updated */
+    uint32_t lastTurningMs;
+    uint32_t lastSpeedCheckMs;
+    /** How many times the fan stalled, and got spun up again */
+    uint32_t stalls;
+    /**
+     * Voltage ratio the host asks for, its PWM duty cycle, for hostPwmPolicy. The caller keeps it up
+     * to date, 0 turns the fan off as far as the host is concerned.
+     */
+    double hostRatio;
 } State;
 
 typedef struct {
@@ -72,23 +138,62 @@ typedef struct {
 
 
 static const int KELVIN_OFFSET = 273;
+/** The fixed resistor (R2) in the thermistor voltage divider */
+static const int REFERENCE_OHMS = 100000;
 static const PtcThermistorConfig PTC_THERMISTOR_10K_3950 = {
     .nominalOhms = 10000,
     .nominalTempK = 25 + KELVIN_OFFSET,
     .beta = 3950,
 };
 
+/** Parameters of the DCM buck model, see ratioToDcmBuckDutyCycle */
+static const double DCM_INPUT_VOLTAGE = 12.0;
+static const double DCM_INDUCTOR_VALUE = 47e-6;
+static const double DCM_OUTPUT_CURRENT = 0.2;
+
 double filterReadings(double newReading, double lastReading);
 
+/** filterReadings for a reading that stands in for elapsedMs, instead of one 100Hz sample */
+double filterReadingsElapsed(double newReading, double lastReading, uint32_t elapsedMs);
+
 double resistanceToTempC(double thermistorOhms, const PtcThermistorConfig *config);
 
 double ratioToUnknownBridgeResistance(double voltageRatio, double knownResistance);
 
 double tempCountsToC(uint32_t tempCounts, const PtcThermistorConfig *config);
 
+/** Temperature from the sum of 2**sampleBits ADC readings, see readAdc */
+double tempSumToC(uint32_t tempSum, int sampleBits, const PtcThermistorConfig *config);
+
+/** Smallest ADC reading that reads as tempC or hotter, the inverse of tempCountsToC */
+uint32_t tempCToCounts(double tempC, const PtcThermistorConfig *config);
+
 double fanVoltageRatio(double newTempC, uint32_t currentMs, const Config *config, State *state);
 
+/**
+ * fanVoltageRatio for a reading that stands in for the last elapsedMs, for when the loop doesn't
+ * run every 10ms. The filter coefficient follows elapsedMs, so the cutoff stays at 0.1Hz.
+ */
+double fanVoltageRatioHeld(double newTempC, uint32_t elapsedMs, uint32_t currentMs, const Config *config,
+                           State *state);
+
+/**
+ * How long to wait before the next control iteration: CONTROL_PERIOD_MIN_MS while spinning up or
+ * while the temperature is on the move, and otherwise twice as long as last time, up to
+ * CONTROL_PERIOD_MAX_MS. Should be called after fanVoltageRatio(newTempC, ...).
+ */
+uint32_t nextControlPeriodMs(double newTempC, uint32_t lastPeriodMs, const State *state);
+
+/**
+ * fanVoltageRatio for while the ADC watchdog sees tempMaxC or hotter: skips straight to
+ * fanMaxDutyCycle, and restarts the filter at newTempC instead of letting it catch up.
+ */
+double fanVoltageRatioOverTemp(double newTempC, uint32_t currentMs, const Config *config, State *state);
+
 double ratioToDcmBuckDutyCycle(double voltageRatio);
 
+/** ratioToDcmBuckDutyCycle at another switching frequency than PWM_FREQ_HZ */
+double ratioToDcmBuckDutyCycleAt(double voltageRatio, double switchingFrequency);
+
 
 #endif//FIRMWARE_LOGIC_H
@@ -0,0 +1,238 @@
+#include "logic_counts.h"
+#include "fan_policy.h"
+#include <assert.h>
+
+int32_t tempCToAdcSum(q16_t tempC, const TempTable table) {
+    // temperature goes up with the sum, so find the first sum that is hot enough
+    int32_t low = 0;
+    int32_t high = 4096 * ADC_NUM_SAMPLES;
+    while (low < high) {
+        int32_t middle = (low + high) / 2;
+        if (tempSumToCQ16((uint32_t) middle, ADC_SAMPLE_BITS, table) >= tempC) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+/** The fan curve's voltage ratio at an ADC sum, at the sum's temperature like the double path has it */
+static q16_t fanCurveRatio(int32_t sum, const ConfigQ16 *config, const TempTable table) {
+    q16_t tempC = tempSumToCQ16((uint32_t) sum, ADC_SAMPLE_BITS, table);
+    return interpolateQ16(tempC, config->tempMinC, config->tempMaxC, config->fanMinDutyCycle, config->fanMaxDutyCycle);
+}
+
+/**
+ * How far off interpolating the fan curve from sum0 to sum1 is, halfway in between, in compare values
+ * with DUTY_TABLE_FRAC_BITS fractional bits
+ */
+static uint32_t knotErrorTicks(int32_t sum0, int32_t sum1, const ConfigQ16 *config, const TempTable table,
+                               const DutyTable *dutyTable) {
+    int32_t middle = sum0 + (sum1 - sum0) / 2;
+    q16_t ratio0 = fanCurveRatio(sum0, config, table);
+    q16_t ratio1 = fanCurveRatio(sum1, config, table);
+    q16_t interpolated = ratio0 + (q16_t) (((int64_t) (ratio1 - ratio0) * (middle - sum0)) / (sum1 - sum0));
+    uint32_t ticks = ratioToDcmBuckFracTicksQ16(fanCurveRatio(middle, config, table), dutyTable, DUTY_TABLE_FRAC_BITS);
+    uint32_t interpolatedTicks = ratioToDcmBuckFracTicksQ16(interpolated, dutyTable, DUTY_TABLE_FRAC_BITS);
+    return ticks > interpolatedTicks ? ticks - interpolatedTicks : interpolatedTicks - ticks;
+}
+
+void compileCountConfig(const ConfigQ16 *config, const TempTable table, const DutyTable *dutyTable,
+                        int tickFracBits, CountConfig *countConfig) {
+    assert(config->tempMaxC - config->tempMinC <= COUNT_CONFIG_MAX_STEPS * Q16_ONE);
+
+    countConfig->onSum = tempCToAdcSum(config->tempMinC, table);
+    countConfig->offSum = tempCToAdcSum(config->tempMinC - config->tempHysteresisC, table);
+    countConfig->fanSpinupTimeMs = config->fanSpinupTimeMs;
+    countConfig->fanMinRpm = config->fanMinRpm;
+    countConfig->fanStallTimeMs = config->fanStallTimeMs;
+    countConfig->hostPwmPolicy = config->hostPwmPolicy;
+    countConfig->minRatio = config->fanMinDutyCycle;
+    countConfig->dutyTable = dutyTable;
+    countConfig->maxRatio = config->fanMaxDutyCycle;
+    countConfig->tickFracBits = tickFracBits;
+    countConfig->spinupTicks = ratioToDcmBuckFracTicksQ16(config->fanSpinupDutyCycle, dutyTable, tickFracBits);
+    countConfig->maxTicks = ratioToDcmBuckFracTicksQ16(config->fanMaxDutyCycle, dutyTable, tickFracBits);
+
+    // a single reading can't be more precise than the sum, so round up
+    int32_t overTempSum = tempCToAdcSum(config->tempMaxC, table);
+    countConfig->overTempCounts = (uint32_t) (overTempSum + ADC_NUM_SAMPLES - 1) >> ADC_SAMPLE_BITS;
+    // a quarter of a degree, where the degrees are the narrowest
+    countConfig->steadySum = overTempSum - tempCToAdcSum(config->tempMaxC - Q16_ONE / 4, table);
+
+    // one knot per degree from tempMinC, and one at tempMaxC. Right below the 100% knee, a degree is
+    // worth over 100 ticks, and the thermistor's curve within it would show in the compare value, so
+    // those degrees get split in halves, quarters..., for as long as there are knots to spare.
+    uint32_t knot = 0;
+    uint32_t spareKnots = COUNT_CONFIG_SPLIT_KNOTS;
+    q16_t tempC = config->tempMinC;
+    while (1) {
+        countConfig->knotSums[knot] = tempCToAdcSum(tempC, table);
+        // the sum is a hundredth of a degree or so past tempC, which is worth a tick at the knee
+        countConfig->knotRatios[knot] = fanCurveRatio(countConfig->knotSums[knot], config, table);
+        knot++;
+        if (tempC == config->tempMaxC) { break; }
+
+        q16_t step = Q16_ONE - ((tempC - config->tempMinC) & (Q16_ONE - 1));
+        if (step > config->tempMaxC - tempC) { step = config->tempMaxC - tempC; }
+        q16_t wholeStep = step;
+        while (spareKnots > 0 && step > Q16_ONE >> COUNT_CONFIG_MAX_SPLITS &&
+               knotErrorTicks(countConfig->knotSums[knot - 1], tempCToAdcSum(tempC + step, table), config, table,
+                              dutyTable) > COUNT_CONFIG_MAX_KNOT_ERROR) {
+            step /= 2;
+        }
+        // a knot short of the next degree is one on top of one per degree
+        if (step < wholeStep) { spareKnots--; }
+        tempC += step;
+    }
+    countConfig->numKnots = knot;
+
+    // dividing here means the control loop only has to multiply
+    for (knot = 0; knot + 1 < countConfig->numKnots; knot++) {
+        int32_t sumRange = countConfig->knotSums[knot + 1] - countConfig->knotSums[knot];
+        int64_t ratioRange = countConfig->knotRatios[knot + 1] - countConfig->knotRatios[knot];
+        countConfig->knotSlopes[knot] = sumRange > 0 ? (int32_t) ((ratioRange << 16) / sumRange) : 0;
+    }
+    countConfig->knotSlopes[knot] = 0;
+}
+
+/** ALPHA of filterReadings, at 100Hz */
+#define FILTER_ALPHA_Q24 52542
+
+/** filterReadingsQ16, with the ADC sum instead of the temperature */
+static int32_t filterSum(int32_t newSum, int32_t oldFilteredSum) {
+    int64_t difference = ((int64_t) newSum << COUNT_FILTER_FRAC_BITS) - oldFilteredSum;
+    return oldFilteredSum + (int32_t) ((difference * FILTER_ALPHA_Q24 + (1 << 23)) >> 24);
+}
+
+/** How much of the old value filterSum keeps over 1ms, 1 - FILTER_ALPHA_Q24 to the power of 1/10 */
+#define FILTER_RETENTION_1MS_Q24 \
+    ((int64_t) (__builtin_pow(1.0 - FILTER_ALPHA_Q24 / 16777216.0, 1.0 / 10.0) * 16777216.0 + 0.5))
+
+/** filterSum for a reading that stands in for the last elapsedMs, see filterReadingsElapsed */
+static int32_t filterSumElapsed(int32_t newSum, int32_t oldFilteredSum, uint32_t elapsedMs) {
+    // FILTER_RETENTION_1MS_Q24 to the power of elapsedMs, by squaring
+    int64_t retentionQ24 = 1 << 24;
+    for (int64_t powerQ24 = FILTER_RETENTION_1MS_Q24; elapsedMs != 0; elapsedMs >>= 1) {
+        if (elapsedMs & 1) { retentionQ24 = (retentionQ24 * powerQ24 + (1 << 23)) >> 24; }
+        powerQ24 = (powerQ24 * powerQ24 + (1 << 23)) >> 24;
+    }
+    int64_t difference = ((int64_t) newSum << COUNT_FILTER_FRAC_BITS) - oldFilteredSum;
+    return oldFilteredSum + (int32_t) ((difference * ((1 << 24) - retentionQ24) + (1 << 23)) >> 24);
+}
+
+static void transitionStateCounts(CountState *state, enum ProcessState newState, uint32_t currentMs) {
+    state->state = newState;
+    state->lastChangeTimeMs = currentMs;
+}
+
+/** boostToMinSpeed in logic.c */
+static q16_t boostToMinSpeedCounts(q16_t ratio, uint32_t currentMs, const CountConfig *config, CountState *state) {
+    if (config->fanMinRpm == 0) { return ratio; }
+    int32_t steps = minSpeedBoostSteps(state->rpm, config->fanMinRpm, currentMs, state->lastChangeTimeMs,
+                                       &state->lastSpeedCheckMs);
+    state->minSpeedBoost += steps * MIN_SPEED_BOOST_Q16_PER_MS / 4;
+    state->minSpeedBoost = clampQ16(state->minSpeedBoost, 0, config->maxRatio);
+    q16_t boosted = ratio + state->minSpeedBoost;
+    return boosted < config->maxRatio ? boosted : config->maxRatio;
+}
+
+/** combineHostRatio in logic.c */
+static q16_t combineHostRatioCounts(q16_t ratio, const CountConfig *config, const CountState *state) {
+    if (config->hostPwmPolicy == HOST_PWM_IGNORE) { return ratio; }
+    if (hostRatioWins(config->hostPwmPolicy, state->hostRatio > ratio)) { ratio = state->hostRatio; }
+    return clampQ16(ratio, config->minRatio, config->maxRatio);
+}
+
+/** fanCompareValueCounts, once state->filteredSum has been updated */
+static uint32_t fanCompareValueFiltered(uint32_t currentMs, const CountConfig *config, CountState *state) {
+    // the filter stalls just short of its input, so round instead of truncating
+    int32_t sum = (state->filteredSum + (1 << (COUNT_FILTER_FRAC_BITS - 1))) >> COUNT_FILTER_FRAC_BITS;
+    switch (state->state) {
+        case FAN_OFF: {
+            if (tempWantsFan(config->hostPwmPolicy, sum >= config->onSum) ||
+                hostWantsFan(config->hostPwmPolicy, state->hostRatio > 0)) {
+                // fan should be turned on
+                transitionStateCounts(state, FAN_SPINUP, currentMs);
+                // fall-through
+                goto fan_spinup;
+            } else {
+                // fan should remain off
+                return 0;
+            }
+        }
+        case FAN_SPINUP:
+        fan_spinup: {
+            uint32_t elapsedMs = currentMs - state->lastChangeTimeMs;
+            if (elapsedMs < config->fanSpinupTimeMs) {
+                // fan is still spinning up, so keep the duty cycle at the spinup value
+                return config->spinupTicks;
+            } else {
+                // fan has finished spinning up, so transition to the normal operating state
+                transitionStateCounts(state, FAN_ON, currentMs);
+                goto fan_on;
+            }
+        }
+        case FAN_ON:
+        fan_on: {
+            int tempOn = tempWantsFan(config->hostPwmPolicy, sum >= config->offSum);
+            if (!tempOn && !hostWantsFan(config->hostPwmPolicy, state->hostRatio > 0)) {
+                // fan should be turned off
+                transitionStateCounts(state, FAN_OFF, currentMs);
+                return 0;
+            } else if (fanStalled(state->rpm, config->fanMinRpm, config->fanStallTimeMs, currentMs,
+                                  state->lastChangeTimeMs, &state->lastTurningMs)) {
+                // the tach says it's not turning, so give it the spinup kick again
+                state->stalls++;
+                transitionStateCounts(state, FAN_SPINUP, currentMs);
+                return config->spinupTicks;
+            } else {
+                // find the knot right below the sum, and interpolate from there
+                uint32_t knot = 0;
+                while (knot + 1 < config->numKnots && sum >= config->knotSums[knot + 1]) { knot++; }
+                int32_t offset = sum > config->knotSums[knot] ? sum - config->knotSums[knot] : 0;
+                q16_t ratio = tempOn ? config->knotRatios[knot] +
+                                           (q16_t) (((int64_t) offset * config->knotSlopes[knot]) >> 16)
+                                     : config->minRatio;
+                ratio = combineHostRatioCounts(ratio, config, state);
+                ratio = boostToMinSpeedCounts(ratio, currentMs, config, state);
+                state->targetRatio = ratio;
+                return ratioToDcmBuckFracTicksQ16(ratio, config->dutyTable, config->tickFracBits);
+            }
+        }
+        default:
+            assert(0);
+    }
+}
+
+uint32_t fanCompareValueCounts(int32_t tempSum, uint32_t currentMs, const CountConfig *config, CountState *state) {
+    state->filteredSum = filterSum(tempSum, state->filteredSum);
+    return fanCompareValueFiltered(currentMs, config, state);
+}
+
+uint32_t fanCompareValueCountsHeld(int32_t tempSum, uint32_t elapsedMs, uint32_t currentMs, const CountConfig *config,
+                                   CountState *state) {
+    state->filteredSum = filterSumElapsed(tempSum, state->filteredSum, elapsedMs);
+    return fanCompareValueFiltered(currentMs, config, state);
+}
+
+uint32_t nextControlPeriodMsCounts(int32_t tempSum, uint32_t lastPeriodMs, const CountConfig *config,
+                                   const CountState *state) {
+    int32_t difference = tempSum - (state->filteredSum >> COUNT_FILTER_FRAC_BITS);
+    if (state->state == FAN_SPINUP || difference >= config->steadySum || -difference >= config->steadySum) {
+        return CONTROL_PERIOD_MIN_MS;
+    }
+    uint32_t periodMs = 2 * lastPeriodMs;
+    return periodMs < CONTROL_PERIOD_MAX_MS ? periodMs : CONTROL_PERIOD_MAX_MS;
+}
+
+uint32_t fanCompareValueOverTemp(int32_t tempSum, uint32_t currentMs, const CountConfig *config, CountState *state) {
+    state->filteredSum = tempSum << COUNT_FILTER_FRAC_BITS;
+    if (state->state != FAN_ON) {
+        // full speed spins the fan up just as well
+        transitionStateCounts(state, FAN_ON, currentMs);
+    }
+    state->targetRatio = config->maxRatio;
+    return config->maxTicks;
+}
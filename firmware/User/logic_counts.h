@@ -0,0 +1,118 @@
+#ifndef FIRMWARE_LOGIC_COUNTS_H
+#define FIRMWARE_LOGIC_COUNTS_H
+
+#include "logic_fixed.h"
+#include "stdint.h"
+
+/**
+ * Control logic that works directly on ADC sums and TIM1 compare values.
+ *
+ * compileCountConfig translates a ConfigQ16 into ADC-sum thresholds once, so that the control loop
+ * only has to filter, compare and interpolate, without any divisions. Between tempMinC and
+ * tempMaxC, the fan curve gets a knot every degree, and more where the compare value climbs steeply,
+ * the voltage ratio is linearly interpolated in between with a precomputed slope, and the DutyTable
+ * turns it into a compare value.
+ */
+
+/** Supports configs with tempMaxC - tempMinC up to this many degrees */
+#define COUNT_CONFIG_MAX_STEPS 64
+/** Knots on top of one per degree, for splitting the degrees right below the 100% knee */
+#define COUNT_CONFIG_SPLIT_KNOTS 16
+/** A degree is split until interpolating across it is off by at most this many 1/2**DUTY_TABLE_FRAC_BITS ticks */
+#define COUNT_CONFIG_MAX_KNOT_ERROR 4
+/** Down to 1/2**COUNT_CONFIG_MAX_SPLITS of a degree */
+#define COUNT_CONFIG_MAX_SPLITS 4
+#define COUNT_CONFIG_MAX_KNOTS (COUNT_CONFIG_MAX_STEPS + 2 + COUNT_CONFIG_SPLIT_KNOTS)
+
+typedef struct {
+    /** The fan turns on when the filtered ADC sum is at or above this (tempMinC) */
+    int32_t onSum;
+    /** The fan turns off when the filtered ADC sum is below this (tempMinC - tempHysteresisC) */
+    int32_t offSum;
+
+    uint32_t spinupTicks;
+    uint32_t fanSpinupTimeMs;
+    uint32_t fanMinRpm;
+    uint32_t fanStallTimeMs;
+    enum HostPwmPolicy hostPwmPolicy;
+    /** fanMinDutyCycle, the lowest voltage ratio that a host PWM signal gets */
+    q16_t minRatio;
+
+    /** Smallest single ADC reading at tempMaxC or hotter, for the ADC analog watchdog */
+    uint32_t overTempCounts;
+    /** Compare value for fanMaxDutyCycle */
+    uint32_t maxTicks;
+    /** fanMaxDutyCycle, the highest voltage ratio that a host PWM signal or the minimum speed gets */
+    q16_t maxRatio;
+    /** Readings this close to the filtered sum count as steady, see nextControlPeriodMsCounts */
+    int32_t steadySum;
+
+    const DutyTable *dutyTable;
+    /** Fractional bits of all the compare values, for a dithered PWM */
+    int tickFracBits;
+
+    /** Number of knots in knotSums, knotRatios & knotSlopes */
+    uint32_t numKnots;
+    /** ADC sum at each knot, knot 0 is at tempMinC and the last one at tempMaxC */
+    int32_t knotSums[COUNT_CONFIG_MAX_KNOTS];
+    /** Voltage ratio at each knot */
+    q16_t knotRatios[COUNT_CONFIG_MAX_KNOTS];
+    /** Voltage ratio per ADC sum (Q0.32), from each knot to the next one */
+    int32_t knotSlopes[COUNT_CONFIG_MAX_KNOTS];
+} CountConfig;
+
+typedef struct {
+    enum ProcessState state;
+    uint32_t lastChangeTimeMs;
+    /** Low-pass filtered ADC sum, with COUNT_FILTER_FRAC_BITS fractional bits */
+    int32_t filteredSum;
+    /** Voltage ratio of the last compare value while FAN_ON */
+    q16_t targetRatio;
+    /** Same as in State, see there */
+    uint32_t rpm;
+    q16_t minSpeedBoost;
+    uint32_t lastTurningMs;
+    uint32_t lastSpeedCheckMs;
+    uint32_t stalls;
+    q16_t hostRatio;
+} CountState;
+
+#define COUNT_FILTER_FRAC_BITS 12
+
+/** MIN_SPEED_BOOST_PER_MS, in Q16 */
+#define MIN_SPEED_BOOST_Q16_PER_MS 16
+
+/**
+ * Smallest ADC sum (of ADC_NUM_SAMPLES samples) that reads as tempC or hotter, or one past the
+ * largest possible sum if there is none.
+ */
+int32_t tempCToAdcSum(q16_t tempC, const TempTable table);
+
+/**
+ * Builds the thresholds & compare values for config, should be called once at boot
+ *
+ * @param tickFracBits fractional bits of the compare values, 0 for whole timer ticks
+ */
+void compileCountConfig(const ConfigQ16 *config, const TempTable table, const DutyTable *dutyTable,
+                        int tickFracBits, CountConfig *countConfig);
+
+/**
+ * Gets the TIM1 compare value for a new ADC sum, see fanVoltageRatio. In steady state, this is
+ * within a few ticks of feeding the filtered temperature to fanVoltageRatio &
+ * ratioToDcmBuckDutyCycle, and moves smoothly between degrees instead of in steps.
+ */
+uint32_t fanCompareValueCounts(int32_t tempSum, uint32_t currentMs, const CountConfig *config, CountState *state);
+
+/** fanCompareValueCounts for a reading that stands in for the last elapsedMs, see fanVoltageRatioHeld */
+uint32_t fanCompareValueCountsHeld(int32_t tempSum, uint32_t elapsedMs, uint32_t currentMs, const CountConfig *config,
+                                   CountState *state);
+
+/** nextControlPeriodMs, after fanCompareValueCounts(tempSum, ...) */
+uint32_t nextControlPeriodMsCounts(int32_t tempSum, uint32_t lastPeriodMs, const CountConfig *config,
+                                   const CountState *state);
+
+/** fanCompareValueCounts while the ADC watchdog sees tempMaxC or hotter, see fanVoltageRatioOverTemp */
+uint32_t fanCompareValueOverTemp(int32_t tempSum, uint32_t currentMs, const CountConfig *config, CountState *state);
+
+
+#endif//FIRMWARE_LOGIC_COUNTS_H
@@ -0,0 +1,154 @@
+#include "logic_fixed.h"
+
+/** Integer square root, rounded down */
+static uint32_t isqrt32(uint32_t x) {
+    uint32_t result = 0;
+    uint32_t bit = 1u << 30;
+    while (bit > x) { bit >>= 2; }
+    while (bit != 0) {
+        if (x >= result + bit) {
+            x -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
+
+q16_t tempSumToCQ16(uint32_t tempSum, int sampleBits, const TempTable table) {
+    // see temp_table.h for how the knots are laid out, the sample bits are just extra fraction
+    uint32_t xSum = (0x1000u << sampleBits) - (tempSum & ((0x1000u << sampleBits) - 1));
+    uint32_t x = xSum >> sampleBits;
+
+    // find the octave of x, so that (x >> shift) is in [TEMP_TABLE_STEPS, 2 * TEMP_TABLE_STEPS),
+    // or below that for the first group, which is spaced the same as the second one
+    uint32_t shift = 0;
+    while ((x >> shift) >= 2 * TEMP_TABLE_STEPS) { shift++; }
+    uint32_t index = (shift + 1) * TEMP_TABLE_STEPS + (x >> shift) - TEMP_TABLE_STEPS;
+    uint32_t fractionBits = shift + sampleBits;
+    int64_t fraction = xSum & ((1u << fractionBits) - 1);
+    if (fraction == 0) {
+        // exactly on a knot, this also covers x = 4096 which is the last knot
+        return table[index] * (Q16_ONE >> TEMP_TABLE_FRAC_BITS);
+    }
+
+    int32_t lower = table[index];
+    int32_t upper = table[index + 1];
+    int64_t step = ((upper - lower) * fraction * (Q16_ONE >> TEMP_TABLE_FRAC_BITS)) >> fractionBits;
+    return lower * (Q16_ONE >> TEMP_TABLE_FRAC_BITS) + (q16_t) step;
+}
+
+q16_t tempCountsToCQ16(uint32_t tempCounts, const TempTable table) {
+    return tempSumToCQ16(tempCounts, 0, table);
+}
+
+/**
+ * Low-pass filter to eliminate noise & jitter in the temperature readings, see filterReadings.
+ */
+q16_t filterReadingsQ16(q16_t newValue, q16_t oldValue) {
+    // 1 - 1 / (1 + tan(pi * 0.1Hz / 100Hz)), in Q8.24 since it is so small
+    static const int64_t ALPHA_Q24 = 52542;
+    return oldValue + (q16_t) (((newValue - oldValue) * ALPHA_Q24 + (1 << 23)) >> 24);
+}
+
+q16_t clampQ16(q16_t value, q16_t min, q16_t max) {
+    if (value < min) {
+        return min;
+    } else if (value > max) {
+        return max;
+    }
+    return value;
+}
+
+/** Linear interpolation between two points */
+q16_t interpolateQ16(q16_t x, q16_t x0, q16_t x1, q16_t y0, q16_t y1) {
+    q16_t xClamped = clampQ16(x, x0, x1);
+    q16_t xRange = x1 - x0;
+    q16_t yRange = y1 - y0;
+    return y0 + (q16_t) (((int64_t) (xClamped - x0) * yRange) / xRange);
+}
+
+/**
+ * D = sqrt(2 * L * Io / (Vi * T)) * sqrt(r / (1 - r)), which is the same equation as
+ * ratioToDcmBuckDutyCycle with the output voltage written as a ratio of the input voltage.
+ */
+q16_t ratioToDcmBuckDutyCycleQ16(q16_t voltageRatio) {
+    static const q16_t K = Q16(2.0 * DCM_INDUCTOR_VALUE * DCM_OUTPUT_CURRENT * PWM_FREQ_HZ /
+                               DCM_INPUT_VOLTAGE);
+
+    voltageRatio = clampQ16(voltageRatio, 0, Q16_ONE);
+    if (voltageRatio == Q16_ONE) {
+        return Q16_ONE;
+    }
+
+    // K * r / (1 - r) in Q32, so that the square root comes out in Q16
+    uint64_t dutySquared = (((uint64_t) K * (uint32_t) voltageRatio) << 16) /
+                           (uint32_t) (Q16_ONE - voltageRatio);
+    if (dutySquared >= ((uint64_t) 1 << 32)) {
+        // around .95 input the duty cycle exceeds 1.0, so clamp it
+        return Q16_ONE;
+    }
+    return (q16_t) isqrt32((uint32_t) dutySquared);
+}
+
+/**
+ * Interpolates half of a DutyTable at x = 0 .. 0.5, see duty_table.h for how the knots are laid out,
+ * in ticks with fracBits fractional bits
+ */
+static uint32_t dutyTableInterpolate(const uint16_t *knots, uint32_t x, int fracBits) {
+    // find the octave of x, so that (x >> shift) is in [DUTY_TABLE_STEPS, 2 * DUTY_TABLE_STEPS)
+    // (or below that in the first group, which is spaced the same as the second one)
+    uint32_t shift = DUTY_TABLE_UNIT_BITS;
+    while ((x >> shift) >= 2 * DUTY_TABLE_STEPS) { shift++; }
+    uint32_t index = (shift - DUTY_TABLE_UNIT_BITS) * DUTY_TABLE_STEPS + (x >> shift);
+    int32_t fraction = (int32_t) (x & ((1u << shift) - 1));
+
+    // the knots have DUTY_TABLE_FRAC_BITS already, so round only once, to fracBits
+    int32_t lower = knots[index];
+    int32_t upper = knots[index + 1];
+    int32_t fracTicks = (lower << shift) + (upper - lower) * fraction;
+    int bits = (int) shift + DUTY_TABLE_FRAC_BITS - fracBits;
+    return (uint32_t) ((fracTicks + (1 << (bits - 1))) >> bits);
+}
+
+uint32_t ratioToDcmBuckTicksQ16(q16_t voltageRatio, const DutyTable *table) {
+    return ratioToDcmBuckFracTicksQ16(voltageRatio, table, 0);
+}
+
+uint32_t ratioToDcmBuckFracTicksQ16(q16_t voltageRatio, const DutyTable *table, int fracBits) {
+    if (voltageRatio <= 0) {
+        return 0;
+    } else if (voltageRatio >= table->maxRatio) {
+        return dutyTableInterpolate(table->upper, 0, fracBits);
+    } else if (voltageRatio < Q16_ONE / 2) {
+        return dutyTableInterpolate(table->lower, (uint32_t) voltageRatio, fracBits);
+    }
+    return dutyTableInterpolate(table->upper, (uint32_t) (table->maxRatio - voltageRatio), fracBits);
+}
+
+/** DUTY_TABLE_DCM_TICKS in integer math, like ratioToDcmBuckDutyCycleQ16 with k instead of K */
+static uint16_t dcmTicks(int32_t voltageRatio, int32_t k, uint32_t period) {
+    if (voltageRatio <= 0) {
+        return 0;
+    }
+    uint64_t dutySquared = (((uint64_t) k * (uint32_t) voltageRatio) << 16) / (uint32_t) (Q16_ONE - voltageRatio);
+    if (dutySquared >= ((uint64_t) 1 << 32)) {
+        return (uint16_t) (period << DUTY_TABLE_FRAC_BITS);
+    }
+    return (uint16_t) ((isqrt32((uint32_t) dutySquared) * (period << DUTY_TABLE_FRAC_BITS) + (1u << 15)) >> 16);
+}
+
+void compileDutyTable(const DutyTable *profile, uint32_t pwmFreqHz, uint32_t period, DutyTable *table) {
+    // k goes with the switching frequency, the rest of the model doesn't change
+    int32_t k = (int32_t) (((int64_t) profile->dcmK * pwmFreqHz + profile->pwmFreqHz / 2) / profile->pwmFreqHz);
+    table->dcmK = k;
+    table->pwmFreqHz = (int32_t) pwmFreqHz;
+    table->maxRatio = (int32_t) ((((uint64_t) 1 << 32) + (uint32_t) (Q16_ONE + k) / 2) / (uint32_t) (Q16_ONE + k));
+    for (uint32_t knot = 0; knot < DUTY_TABLE_KNOTS; knot++) {
+        table->lower[knot] = dcmTicks(DUTY_TABLE_X_Q16(knot), k, period);
+        table->upper[knot] = dcmTicks(table->maxRatio - DUTY_TABLE_X_Q16(knot), k, period);
+    }
+}
+
@@ -0,0 +1,66 @@
+#ifndef FIRMWARE_LOGIC_FIXED_H
+#define FIRMWARE_LOGIC_FIXED_H
+
+#include "duty_table.h"
+#include "logic.h"
+#include "stdint.h"
+#include "temp_table.h"
+
+/**
+ * Integer-only version of the logic.h API, for the Cortex-M0+ which has no FPU.
+ *
+ * All values are signed Q16.16 fixed point: 16 integer bits and 16 fractional bits.
+ */
+typedef int32_t q16_t;
+
+#define Q16_ONE ((q16_t) 1 << 16)
+
+/**
+ * Converts a constant to Q16.16. Only use this with constant expressions, otherwise the
+ * soft-float routines get linked in again.
+ */
+#define Q16(x) ((q16_t) ((x) * 65536.0 + ((x) >= 0 ? 0.5 : -0.5)))
+
+/** Same as Config, see there for documentation */
+typedef struct {
+    q16_t fanMinDutyCycle;
+    q16_t fanMaxDutyCycle;
+    q16_t fanSpinupDutyCycle;
+    uint32_t fanSpinupTimeMs;
+    uint32_t fanMinRpm;
+    uint32_t fanStallTimeMs;
+
+    q16_t tempMinC;
+    q16_t tempMaxC;
+    q16_t tempHysteresisC;
+
+    enum HostPwmPolicy hostPwmPolicy;
+} ConfigQ16;
+
+q16_t clampQ16(q16_t value, q16_t min, q16_t max);
+
+q16_t interpolateQ16(q16_t x, q16_t x0, q16_t x1, q16_t y0, q16_t y1);
+
+q16_t filterReadingsQ16(q16_t newReading, q16_t lastReading);
+
+q16_t tempCountsToCQ16(uint32_t tempCounts, const TempTable table);
+
+/** Interpolates the sum of 2**sampleBits ADC readings in a TempTable */
+q16_t tempSumToCQ16(uint32_t tempSum, int sampleBits, const TempTable table);
+
+q16_t ratioToDcmBuckDutyCycleQ16(q16_t voltageRatio);
+
+/** Looks up the TIM1 compare value for a voltage ratio in a DutyTable, from 0 to PWM_PERIOD */
+uint32_t ratioToDcmBuckTicksQ16(q16_t voltageRatio, const DutyTable *table);
+
+/** ratioToDcmBuckTicksQ16, with fracBits fractional bits for a dithered PWM */
+uint32_t ratioToDcmBuckFracTicksQ16(q16_t voltageRatio, const DutyTable *table, int fracBits);
+
+/**
+ * Builds the DutyTable for profile at another PWM frequency, with period ticks at 100% duty cycle,
+ * in integer math, so at runtime. It's within a tick of what DUTY_TABLE_DCM would make.
+ */
+void compileDutyTable(const DutyTable *profile, uint32_t pwmFreqHz, uint32_t period, DutyTable *table);
+
+
+#endif//FIRMWARE_LOGIC_FIXED_H
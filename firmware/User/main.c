@@ -1,229 +1,1243 @@
+#include "dither.h"
 #include "logic.h"
-#include "py32f0xx.h"
+#include "logic_counts.h"
+#include "logic_fixed.h"
+#include "overcurrent.h"
+#include "peripherals.h"
+#include "rpm_estimate.h"
+#include "tach.h"
 
+#ifdef USE_FIXED_POINT
+typedef ConfigQ16 AppConfig;
+#define CONFIG_VALUE(x) Q16(x)
+#else
+typedef Config AppConfig;
+#define CONFIG_VALUE(x) (x)
+#endif
 
-void SysTick_Handler() {
-    HAL_IncTick();
+
+/**
+ * Tickless timebase: instead of a 1kHz SysTick interrupt, TIM16 counts milliseconds by itself,
+ * and only interrupts when its 16-bit counter wraps (every 65s), or at a deadline set by wakeAt.
+ * getTickMs adds the counter to tickBaseMs, which keeps the usual uint32 wrap-around: the
+ * milliseconds up to the last time the counter wrapped, and in STOP mode.
+ */
+static volatile uint32_t tickBaseMs;
+
+/** Milliseconds since boot */
+uint32_t getTickMs(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t baseMs = tickBaseMs;
+    uint32_t counter = TIM16->CNT;
+    if (TIM16->SR & TIM_SR_UIF) {
+        // the counter wrapped, but the interrupt hasn't had a chance to count it yet
+        baseMs += 0x10000;
+        counter = TIM16->CNT;
+    }
+    __set_PRIMASK(primask);
+    return baseMs + counter;
 }
 
-void checkOk(int ok) {
-    if (ok != HAL_OK) {
-        __asm__("bkpt #0");
-        while (1) { __NOP(); }
+/** The counter stops in STOP mode, so the time spent there gets added separately */
+void addTickMs(uint32_t ms) {
+    tickBaseMs += ms;
+}
+
+void TIM16_IRQHandler(void) {
+    // the status flags clear by writing 0, and ignore 1s
+    if (TIM16->SR & TIM_SR_UIF) {
+        TIM16->SR = ~TIM_SR_UIF;
+        tickBaseMs += 0x10000;
+    }
+    if (TIM16->SR & TIM_SR_CC1IF) {
+        // wakeAt's deadline, waking up the core was all it had to do
+        TIM16->SR = ~TIM_SR_CC1IF;
+        TIM16->DIER &= ~TIM_DIER_CC1IE;
     }
 }
 
-static const int SYSCLOCK_FREQ_HZ = (int) 12e6;
+/** Makes TIM16 interrupt at deadlineMs (if it's in the next 65s), to wake up the core */
+static void wakeAt(uint32_t deadlineMs) {
+    uint32_t remainingMs = deadlineMs - getTickMs();
+    if (remainingMs == 0 || remainingMs > 0xffff) { return; }
+    TIM16->CCR1 = (TIM16->CNT + remainingMs) & 0xffff;
+    TIM16->SR = ~TIM_SR_CC1IF;
+    TIM16->DIER |= TIM_DIER_CC1IE;
+}
 
-static void APP_SystemClockConfig(void) {
-    /** use internal oscillator, sysclk = 16MHz */
-    checkOk(HAL_RCC_OscConfig(&(RCC_OscInitTypeDef){
-        .OscillatorType = RCC_OSCILLATORTYPE_HSI,
-        .HSIState = RCC_HSI_ON,
-        .HSIDiv = RCC_HSI_DIV2, /* 12MHz */
-        .HSICalibrationValue = RCC_HSICALIBRATION_24MHz,
-    }));
-    // make sure we have a LSI for the watchdog
-    checkOk(HAL_RCC_OscConfig(&(RCC_OscInitTypeDef){
-        .OscillatorType = RCC_OSCILLATORTYPE_LSI,
-        .LSIState = RCC_LSI_ON,
-    }));
+/** SYSCLK is SYSCLOCK_FREQ_HZ >> clockShift, see setClockShift */
+static uint32_t clockShift;
 
-    checkOk(HAL_RCC_ClockConfig(
-        &(RCC_ClkInitTypeDef){
-            .ClockType = RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_SYSCLK | RCC_CLOCKTYPE_PCLK1,
-            .SYSCLKSource = RCC_SYSCLKSOURCE_HSI, /* SYSCLK source */
-            .AHBCLKDivider = RCC_SYSCLK_DIV1,
-        },
-        FLASH_LATENCY_0));// latency 0 for <= 24MHz
+/** Converts TIM1 ticks at SYSCLOCK_FREQ_HZ to ticks at the current SYSCLK, rounded */
+static uint32_t scaleTicks(uint32_t ticks) {
+    return (ticks + ((1u << clockShift) >> 1)) >> clockShift;
 }
 
-// uses LSI clock, 32kHz
-IWDG_HandleTypeDef hiwdg = {
-    .Instance = IWDG,
-    .Init = {
-        .Prescaler = IWDG_PRESCALER_256,
-        .Reload = 125,// 1s
-    },
-};
+typedef struct {
+    /** Sums of ADC_NUM_SAMPLES readings */
+    uint32_t tempSum;
+    uint32_t fanSum;
+} AdcResults;
 
-static void APP_Watchdog() {
-    checkOk(HAL_IWDG_Init(&hiwdg));
-    HAL_IWDG_Refresh(&hiwdg);
-}
-
-
-ADC_HandleTypeDef hadc1 = {
-    .Instance = ADC1,
-    .Init = (ADC_InitTypeDef){
-        .ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4,            /* Analog ADC clock source is PCLK*/
-        .Resolution = ADC_RESOLUTION_12B,                      /* conversion resolution 12bit*/
-        .DataAlign = ADC_DATAALIGN_RIGHT,                      /* data right alignment */
-        .ScanConvMode = ADC_SCAN_DIRECTION_FORWARD,            /* scan sequence direction: up (from channel 0 to channel 11)*/
-        .EOCSelection = ADC_EOC_SINGLE_CONV,                   /* ADC_EOC_SINGLE_CONV: single sampling, ADC_EOC_SEQ_CONV: sequence sampling*/
-        .LowPowerAutoWait = ENABLE,                            /* ENABLE=After reading the ADC value, start the next conversion , DISABLE=Direct conversion */
-        .ContinuousConvMode = DISABLE,                         /* single conversion mode */
-        .DiscontinuousConvMode = DISABLE,                      /* Disable discontinuous mode */
-        .ExternalTrigConv = ADC_SOFTWARE_START,                /* software trigger */
-        .ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE, /* No trigger edge */
-        .Overrun = ADC_OVR_DATA_OVERWRITTEN,                   /* ADC_OVR_DATA_OVERWRITTEN=overrun when overloaded, ADC_OVR_DATA_PRESERVED=keep old value*/
-        .SamplingTimeCommon = ADC_SAMPLETIME_239CYCLES_5,      /* channel sampling time is 239.5ADC clock cycle */
-    },
-};
+/** How many blocks of samples have been completed so far */
+static volatile uint32_t adcCompletedBlocks;
 
-static void APP_AdcConfig(void) {
-    __HAL_RCC_ADC_FORCE_RESET();
-    __HAL_RCC_ADC_RELEASE_RESET(); /* Reset ADC */
-    __HAL_RCC_ADC_CLK_ENABLE();    /* Enable ADC clock */
-
-    // PA3 is TEMP_SENSE
-    HAL_GPIO_Init(
-        GPIOA,
-        &(GPIO_InitTypeDef){
-            .Mode = GPIO_MODE_ANALOG,
-            .Pin = GPIO_PIN_3});
-    // PA4 is FAN_SENSE
-    HAL_GPIO_Init(
-        GPIOA,
-        &(GPIO_InitTypeDef){
-            .Mode = GPIO_MODE_ANALOG,
-            .Pin = GPIO_PIN_4});
-
-    checkOk(HAL_ADC_Calibration_Start(&hadc1));
-    checkOk(HAL_ADC_Init(&hadc1));
-    checkOk(HAL_ADC_ConfigChannel(&hadc1, &(ADC_ChannelConfTypeDef){
-                                              .Rank = ADC_RANK_CHANNEL_NUMBER,
-                                              .Channel = ADC_CHANNEL_3,
-                                          }));
-}
-
-
-static const int PWM_PERIOD = (SYSCLOCK_FREQ_HZ / PWM_FREQ_HZ) - 1;
-
-TIM_HandleTypeDef htim1 = {
-    .Instance = TIM1,
-    .Init = {
-        .Period = PWM_PERIOD,
-        .Prescaler = 0,
-        .ClockDivision = TIM_CLOCKDIVISION_DIV1,
-        .CounterMode = TIM_COUNTERMODE_UP,
-        .RepetitionCounter = 0,
-        .AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE,
-    },
-};
+/**
+ * Set when the analog watchdog sees a single TEMP_SENSE sample at tempMaxC or hotter, so the fan goes
+ * to full speed within one conversion instead of waiting for the filter to catch up. The watchdog
+ * interrupt stays off until the control loop sees the temperature drop back down.
+ */
+static volatile uint32_t adcOverTemp;
+/** Compare value that the watchdog interrupt sets, for fanMaxDutyCycle */
+static uint32_t adcOverTempTicks;
+
+static void setCompareValue(uint32_t compareValue);
+
+#ifdef OVERCURRENT_LIMIT
+#if defined(DMA1)
+#error "OVERCURRENT_LIMIT checks every FAN_SENSE sample in the ADC interrupt, which the DMA takes over"
+#endif
+/** R2, the low-side shunt that PA4 reads the ISENSE net across */
+#define SHUNT_MILLIOHM 1000
+/** The ADC's reference is VCC, from the 5V regulator */
+#define ADC_REFERENCE_MV 5000
+/** Fan current that cuts the output, 5 times DUTY_TABLE_12V_200MA's, so only a short or a stall gets there */
+#define OVERCURRENT_LIMIT_MA 1000
+/**
+ * A single FAN_SENSE reading at or above this cuts the PWM output. R3/C5 average the shunt's voltage
+ * over about 1ms, so it's the average current, not the peak of each period, and the limit takes a
+ * millisecond or so to see a step.
+ */
+static const uint32_t OVERCURRENT_COUNTS = OVERCURRENT_LIMIT_MA * SHUNT_MILLIOHM / 1000 * 4096 / ADC_REFERENCE_MV;
+/** How many times the output was cut, for overcurrentStep, and for reading with the debugger */
+static volatile uint32_t overcurrentTrips;
+
+static void tripOvercurrent(void);
+#endif
+
+#ifdef RPM_ESTIMATE
+/**
+ * FAN_SENSE samples per estimateRpm sample, for about 1.5kHz: the scan takes 2 * (239.5 + 12.5)
+ * cycles of the 3MHz ADC clock, and ADC_PWM_SYNC samples FAN_SENSE every other PWM period
+ */
+#ifdef ADC_PWM_SYNC
+#define RPM_DECIMATION 8
+#else
+#define RPM_DECIMATION 4
+static const uint32_t RPM_SCAN_HZ = 3000000 / (2 * 252);
+#endif
+
+/**
+ * Two windows of decimated FAN_SENSE samples, one being filled by the ADC or DMA interrupt, and the
+ * last complete one
+ */
+static uint16_t rpmWindows[2][RPM_WINDOW];
+static volatile uint32_t rpmFillingWindow;
+static uint32_t rpmSamplesInWindow;
+static uint32_t rpmDecimatedSum;
+static uint32_t rpmSamplesInSum;
+static volatile uint32_t rpmCompletedWindows;
+/** Set while estimateRpm reads the complete window, so the interrupt doesn't hand over the other one */
+static volatile uint32_t rpmWindowInUse;
+
+/** Takes one more FAN_SENSE sample, from the ADC or DMA interrupt */
+static void addRpmSample(uint32_t value) {
+    rpmDecimatedSum += value;
+    if (++rpmSamplesInSum < RPM_DECIMATION) { return; }
+    rpmWindows[rpmFillingWindow][rpmSamplesInWindow] = (uint16_t) rpmDecimatedSum;
+    rpmDecimatedSum = 0;
+    rpmSamplesInSum = 0;
+
+    if (++rpmSamplesInWindow == RPM_WINDOW) {
+        // start over on the same window, if the control loop is still busy with the other one
+        rpmSamplesInWindow = 0;
+        if (rpmWindowInUse) { return; }
+        rpmFillingWindow ^= 1;
+        rpmCompletedWindows++;
+    }
+}
+#endif
+
+static void handleAdcWatchdog(void) {
+    if (!(ADC1->IER & ADC_IER_AWDIE) || !(ADC1->ISR & ADC_ISR_AWD)) { return; }
+    ADC1->IER &= ~ADC_IER_AWDIE;
+    // the ADC's flags clear by writing 1
+    ADC1->ISR = ADC_ISR_AWD;
+    setCompareValue(adcOverTempTicks);
+    adcOverTemp = 1;
+}
+
+/** Lets the watchdog interrupt fire again, once the temperature is back below tempMaxC */
+static void rearmAdcWatchdog(void) {
+    adcOverTemp = 0;
+    ADC1->ISR = ADC_ISR_AWD;
+    ADC1->IER |= ADC_IER_AWDIE;
+}
+
+/**
+ * The ADC scans TEMP_SENSE and FAN_SENSE continuously, 80us/conversion, and the samples go into one
+ * of two blocks while the control loop works on the other one. So the CPU can sleep while sampling,
+ * instead of polling for every conversion.
+ */
+#if defined(DMA1)
+/** Two blocks of interleaved TEMP_SENSE, FAN_SENSE samples, filled by the DMA in a circle */
+static uint16_t adcSamples[2][2 * ADC_NUM_SAMPLES];
+/** The block that the DMA finished last */
+static const uint16_t *volatile adcCompletedSamples;
+
+#ifdef RPM_ESTIMATE
+static void addRpmBlock(const uint16_t *samples) {
+    for (int i = 0; i < ADC_NUM_SAMPLES; i++) { addRpmSample(samples[2 * i + 1]); }
+}
+#endif
+
+void DMA1_Channel1_IRQHandler(void) {
+    if (DMA1->ISR & DMA_ISR_HTIF1) {
+        DMA1->IFCR = DMA_IFCR_CHTIF1;
+        adcCompletedSamples = adcSamples[0];
+        adcCompletedBlocks++;
+#ifdef RPM_ESTIMATE
+        addRpmBlock(adcSamples[0]);
+#endif
+    }
+    if (DMA1->ISR & DMA_ISR_TCIF1) {
+        DMA1->IFCR = DMA_IFCR_CTCIF1;
+        adcCompletedSamples = adcSamples[1];
+        adcCompletedBlocks++;
+#ifdef RPM_ESTIMATE
+        addRpmBlock(adcSamples[1]);
+#endif
+    }
+}
+
+void ADC_COMP_IRQHandler(void) {
+    handleAdcWatchdog();
+}
+#else
+// no DMA on the PY32F002A, so add up the samples in the end-of-conversion interrupt instead
+
+/** Sums of the block being filled, and of the one before it */
+static AdcResults adcBlocks[2];
+static volatile uint32_t adcFillingBlock;
+static uint32_t adcSamplesInBlock;
+
+void ADC_COMP_IRQHandler(void) {
+    handleAdcWatchdog();
+
+    // reading the data register clears EOC, and the end-of-sequence flag is only set for FAN_SENSE
+    uint32_t value = ADC1->DR;
+    if (!(ADC1->ISR & ADC_ISR_EOSEQ)) {
+        adcBlocks[adcFillingBlock].tempSum += value;
+        return;
+    }
+    ADC1->ISR = ADC_ISR_EOSEQ;
+    adcBlocks[adcFillingBlock].fanSum += value;
+#ifdef OVERCURRENT_LIMIT
+    if (value >= OVERCURRENT_COUNTS) { tripOvercurrent(); }
+#endif
+#ifdef RPM_ESTIMATE
+    addRpmSample(value);
+#endif
+
+    if (++adcSamplesInBlock == ADC_NUM_SAMPLES) {
+        // hand over the block, and start filling the other one
+        adcSamplesInBlock = 0;
+        adcFillingBlock ^= 1;
+        adcBlocks[adcFillingBlock] = (AdcResults){0};
+        adcCompletedBlocks++;
+    }
+}
+#endif
+
+/** Blocks that readAdc has already returned */
+static uint32_t adcReadBlocks;
+
+/** Starts converting from the beginning of a fresh block */
+static void startAdc(void) {
+    adcReadBlocks = adcCompletedBlocks;
+#if !defined(DMA1)
+    adcSamplesInBlock = 0;
+    adcBlocks[adcFillingBlock] = (AdcResults){0};
+#endif
+    startAdcConversions();
+}
+
+/**
+ * @param overTempCounts smallest TEMP_SENSE reading that trips the analog watchdog
+ * @param overTempTicks compare value that the watchdog sets when it trips
+ */
+static void APP_SamplingConfig(uint32_t overTempCounts, uint32_t overTempTicks) {
+    // has to be set up before the ADC starts converting
+    adcOverTempTicks = overTempTicks;
+    APP_AdcConfig(overTempCounts);
+#if defined(DMA1)
+    APP_AdcDmaConfig(adcSamples[0], 2 * 2 * ADC_NUM_SAMPLES);
+#endif
+    startAdc();
+}
 
-static void APP_PwmOutConfig() {
-    __HAL_RCC_TIM1_CLK_ENABLE();
-    __HAL_RCC_GPIOA_CLK_ENABLE();
-
-    // PWM output 200kHz
-    // Pin 7, PA1, TIM1_CH4
-    HAL_GPIO_Init(
-        GPIOA,
-        &(GPIO_InitTypeDef){
-            .Mode = GPIO_MODE_AF_PP,
-            .Pull = GPIO_PULLUP,
-            .Speed = GPIO_SPEED_FREQ_HIGH,
-            .Pin = GPIO_PIN_1,
-            .Alternate = GPIO_AF13_TIM1,
-        });
-
-    checkOk(HAL_TIM_Base_Init(&htim1));
-    checkOk(HAL_TIM_PWM_ConfigChannel(
-        &htim1,
-        &(TIM_OC_InitTypeDef){
-            .OCMode = TIM_OCMODE_PWM1,
-            .OCFastMode = TIM_OCFAST_DISABLE,
-            .OCPolarity = TIM_OCPOLARITY_HIGH,
-            .OCNPolarity = TIM_OCNPOLARITY_LOW,
-            .OCIdleState = TIM_OCIDLESTATE_RESET,
-            .OCNIdleState = TIM_OCNIDLESTATE_RESET,
-            .Pulse = 0,// duty cycle = 0%
-        },
-        TIM_CHANNEL_4));
-    checkOk(HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_4));
+#ifdef CONTROL_PWM_SYNC
+/**
+ * TIM1 only sends an update event every this many PWM periods (5ms), and every
+ * CONTROL_UPDATE_DECIMATION'th one runs the control loop, for exactly CONTROL_PERIOD_MIN_MS.
+ */
+static const int CONTROL_UPDATE_PERIODS = 150;
+static const int CONTROL_UPDATE_DECIMATION = 2;
+#endif
+
+/** The PWM frequency, and TIM1's period for it at SYSCLOCK_FREQ_HZ, see setPwmFrequency */
+static uint32_t pwmFreqHz = PWM_FREQ_HZ;
+static uint32_t pwmPeriod = PWM_PERIOD;
+
+#ifdef ADC_PWM_SYNC
+/**
+ * Point in the PWM period (timer ticks after the rising edge) at which TIM1 triggers an ADC
+ * conversion. Every period converts one channel, so TEMP_SENSE & FAN_SENSE each get sampled at
+ * 15kHz, always at the same point of the switching ripple.
+ */
+#define ADC_TRIGGER_PHASE_TICKS (pwmPeriod / 2)
+#endif
+
+#ifdef PWM_DITHER
+#ifdef CONTROL_PWM_SYNC
+#error "PWM_DITHER needs a TIM1 update event at the end of every PWM period"
+#endif
+/**
+ * Compare values have this many fractional bits, which get spread over 2**PWM_DITHER_BITS PWM
+ * periods (533us), for 16 times the duty cycle resolution, see ditherCompareValue.
+ */
+#define PWM_DITHER_BITS 4
+#define PWM_DITHER_PERIODS (1 << PWM_DITHER_BITS)
+#else
+#define PWM_DITHER_BITS 0
+#endif
+
+#ifdef PWM_SLEW
+#ifdef CONTROL_PWM_SYNC
+#error "PWM_SLEW needs a TIM1 update event at the end of every PWM period"
+#endif
+/**
+ * The duty cycle takes at least this long to go from 0% to 100%, so that it ramps instead of
+ * stepping. It's CONTROL_PERIOD_MIN_MS, so every ramp is done by the next iteration.
+ */
+static const uint32_t PWM_SLEW_MS = 10;
+
+/** The most the compare value moves in one PWM period, rounded up */
+static uint32_t pwmSlewStep;
+
+static void updatePwmSlewStep(void) {
+    uint32_t periods = pwmFreqHz * PWM_SLEW_MS / 1000;
+    pwmSlewStep = (((pwmPeriod + 1) << PWM_DITHER_BITS) + periods - 1) / periods;
+}
+#endif
+
+#if defined(PWM_SLEW) || (defined(PWM_DITHER) && !defined(DMA1))
+/** The TIM1 update interrupt works out the compare value for every PWM period */
+#define PWM_UPDATE_INTERRUPT
+#elif defined(PWM_DITHER)
+/** The DMA goes around a pattern of compare values, without interrupting the core */
+#define PWM_DITHER_DMA
+#endif
+
+#if !defined(PWM_UPDATE_INTERRUPT) && !defined(PWM_DITHER_DMA)
+static void setCompareValue(uint32_t compareValue) {
+    TIM1->CCR4 = scaleTicks(compareValue);
+}
+#endif
+
+#ifdef OVERCURRENT_LIMIT
+/** Cuts the PWM output right away, from the ADC interrupt */
+static void tripOvercurrent(void) {
+    if (!(TIM1->BDTR & TIM_BDTR_MOE)) { return; }
+    TIM1->EGR = TIM_EGR_BG;
+    overcurrentTrips++;
+}
+
+/** Turns the PWM output back on after tripOvercurrent */
+static void enablePwmOutput(void) {
+    TIM1->SR = ~TIM_SR_BIF;
+    TIM1->BDTR |= TIM_BDTR_MOE;
+}
+#endif
+
+#ifdef TACH_INPUT
+#ifdef CLOCK_SCALING
+#error "TACH_INPUT times the tach edges with SysTick, which CLOCK_SCALING slows down"
+#endif
+/** Timestamps of the tach edges, see TIM1_CC_IRQHandler */
+static TachEdges tachEdges;
+static TachState tachState;
+
+/** SysTick doesn't keep the time anymore, so it's free to timestamp the tach edges, without interrupts */
+static void APP_TachTimestampConfig(void) {
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+void TIM1_CC_IRQHandler(void) {
+    uint32_t ticks = SysTick_LOAD_RELOAD_Msk - SysTick->VAL;
+    uint32_t counter = TIM1->CNT;
+    // reading CCR2 clears the flag
+    uint32_t capturedTicks = TIM1->CCR2;
+    // back to when the edge came in, TIM1 counts at the core clock too
+    uint32_t sinceCapture = counter >= capturedTicks ? counter - capturedTicks : counter + pwmPeriod + 1 - capturedTicks;
+    captureTachEdge(ticks - sinceCapture, TACH_HOLDOFF_US * (SYSCLOCK_FREQ_HZ / 1000000), &tachEdges);
+}
+#endif
+
+#ifdef PWM_INPUT
+#ifdef TACH_INPUT
+#error "PWM_INPUT and TACH_INPUT both need TIM1_CH2, on PB3"
+#endif
+#ifdef ADC_PWM_SYNC
+#error "PWM_INPUT captures on TIM1 channel 1, which ADC_PWM_SYNC triggers the ADC with"
+#endif
+#if defined(CONTROL_PWM_SYNC) || defined(CLOCK_SCALING) || defined(PWM_FREQ_SWEEP)
+#error "PWM_INPUT has the host set TIM1's period, which CONTROL_PWM_SYNC, CLOCK_SCALING & PWM_FREQ_SWEEP change or count on"
+#endif
+/**
+ * TIM1's frequency without a host PWM signal. The host's rising edges reset TIM1 before it gets to
+ * the end of this period, so the host's has to be faster, which the 4-wire fan spec's 21-28kHz is.
+ */
+static const uint32_t PWM_INPUT_FREE_RUN_HZ = 20000;
+
+/**
+ * The host's period & high time in TIM1 ticks, from the last complete period
+ *
+ * @return 0 if there hasn't been a rising edge since the last call
+ */
+static uint32_t readHostPwmTicks(uint32_t *highTicks) {
+    if (!(TIM1->SR & TIM_SR_CC2IF)) { return 0; }
+    *highTicks = TIM1->CCR1;
+    // reading CCR2 clears the flag
+    return TIM1->CCR2;
+}
+
+static int hostPwmPinHigh(void) {
+    return (GPIOB->IDR & GPIO_IDR_ID3) != 0;
 }
+#endif
 
+#ifdef PWM_DITHER_DMA
+/** The compare value for each PWM period, which go into CCR4 at every update event, in turn */
+static uint16_t ditherPeriodTicks[PWM_DITHER_PERIODS];
+/** The last value given to setCompareValue, see setClockShift */
+static uint32_t ditherFracTicks;
+
+/** Sets the duty cycle in 1/PWM_DITHER_PERIODS ticks, from the next PWM period on */
+static void setCompareValue(uint32_t compareValue) {
+    // the analog watchdog interrupt sets it too, so don't let it see half a pattern
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    ditherFracTicks = compareValue;
+    ditherCompareValue(compareValue >> clockShift, PWM_DITHER_BITS, ditherPeriodTicks);
+    __set_PRIMASK(primask);
+}
+#endif
+
+#ifdef PWM_UPDATE_INTERRUPT
+/** Where the update interrupt takes the compare value, in 1/2**PWM_DITHER_BITS ticks */
+static volatile uint32_t pwmTargetTicks;
+#ifdef PWM_SLEW
+/** Where the ramp is at, in 1/2**PWM_DITHER_BITS ticks, see rescaleCompareValue */
+static uint32_t pwmSlewTicks;
+#endif
+
+/** Sets the duty cycle in 1/2**PWM_DITHER_BITS ticks, the update interrupt takes it from there */
+static void setCompareValue(uint32_t compareValue) {
+    pwmTargetTicks = compareValue;
+}
+
+/** Works out the next period's compare value, which TIM1 loads from CCR4 at the next update event */
+void TIM1_BRK_UP_TRG_COM_IRQHandler(void) {
+    uint32_t ticks = pwmTargetTicks;
+#ifdef PWM_SLEW
+    if (ticks > pwmSlewTicks + pwmSlewStep) {
+        ticks = pwmSlewTicks + pwmSlewStep;
+    } else if (ticks + pwmSlewStep < pwmSlewTicks) {
+        ticks = pwmSlewTicks - pwmSlewStep;
+    }
+    pwmSlewTicks = ticks;
+#endif
+#ifdef PWM_DITHER
+    // the sigma-delta of ditherCompareValue, one period at a time
+    static uint32_t ditherError = 0;
+    ditherError += ticks >> clockShift;
+    uint32_t compareValue = ditherError >> PWM_DITHER_BITS;
+    ditherError &= PWM_DITHER_PERIODS - 1;
+#else
+    uint32_t compareValue = scaleTicks(ticks);
+#endif
+    TIM1->SR = ~TIM_SR_UIF;
+    TIM1->CCR4 = compareValue;
+}
+
+static void APP_PwmUpdateConfig(void) {
+#ifdef PWM_SLEW
+    updatePwmSlewStep();
+#endif
+    TIM1->SR = ~TIM_SR_UIF;
+    NVIC_SetPriority(TIM1_BRK_UP_TRG_COM_IRQn, PRIORITY_HIGH);
+    NVIC_EnableIRQ(TIM1_BRK_UP_TRG_COM_IRQn);
+    TIM1->DIER |= TIM_DIER_UIE;
+}
+#endif
+
+#ifndef CONTROL_PWM_SYNC
+/** A compare value for a period of fromPeriod, at the same duty cycle for one of pwmPeriod */
+static uint32_t rescaleTicks(uint32_t ticks, uint32_t fromPeriod) {
+    return (ticks * (pwmPeriod + 1) + (fromPeriod + 1) / 2) / (fromPeriod + 1);
+}
+
+/**
+ * Carries the compare value over from a period of fromPeriod to pwmPeriod at the same duty cycle, and
+ * with PWM_SLEW where the ramp is at, so that neither is past the end of a shorter period. Call it
+ * with interrupts off, along with a new TIM1->ARR, or as soon as the host's period has changed.
+ */
+static void rescaleCompareValue(uint32_t fromPeriod) {
+    TIM1->CCR4 = rescaleTicks(TIM1->CCR4, fromPeriod);
+#ifdef PWM_UPDATE_INTERRUPT
+    pwmTargetTicks = rescaleTicks(pwmTargetTicks, fromPeriod);
+#ifdef PWM_SLEW
+    pwmSlewTicks = rescaleTicks(pwmSlewTicks, fromPeriod);
+#endif
+#elif defined(PWM_DITHER_DMA)
+    setCompareValue(rescaleTicks(ditherFracTicks, fromPeriod));
+#endif
+}
+#endif
+
+#ifndef USE_FIXED_POINT
 static void setPwmDutyCycle(double dutyCycle) {
     if (dutyCycle < 0.0) {
         dutyCycle = 0.0;
     } else if (dutyCycle > 1.0) {
         dutyCycle = 1.0;
     }
-    __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_4, (uint32_t) (dutyCycle * PWM_PERIOD));
+    setCompareValue((uint32_t) (dutyCycle * (pwmPeriod << PWM_DITHER_BITS)));
 }
+#endif
 
-typedef struct {
-    uint32_t tempCounts;
-    uint32_t fanCounts;
-} AdcResults;
+#ifdef MEASURE_SLEEP
+/** Updated once a second, for reading with the debugger */
+volatile struct {
+    /** Cycles spent in WFI, out of totalCycles, both at SYSCLOCK_FREQ_HZ */
+    uint32_t sleepCycles;
+    uint32_t totalCycles;
+    /** Share of the time that the core was awake, in 1/1000 */
+    uint32_t activePermille;
+    /** Awake cycles per control iteration, interrupts included */
+    uint32_t activeCyclesPerIteration;
+    /** Most cycles that a single controlStep took */
+    uint32_t maxControlStepCycles;
+} sleepReport;
 
-AdcResults readAdc() {
-    checkOk(HAL_ADC_Start(&hadc1));
+/** Cycles spent in WFI since the last report */
+static uint32_t sleepCyclesSinceReport;
+/** controlStep calls since the last report, and the most cycles one of them took */
+static uint32_t iterationsSinceReport;
+static uint32_t maxControlStepCyclesSinceReport;
+
+/** SysTick doesn't keep the time anymore, so it's free to count cycles, without interrupts */
+static void APP_SleepMeasurementConfig(void) {
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+static void updateSleepReport(void) {
+    static uint32_t lastReportMs = 0;
+    uint32_t elapsedMs = getTickMs() - lastReportMs;
+    if (elapsedMs < 1000) { return; }
+    lastReportMs += elapsedMs;
+
+    uint32_t totalCycles = elapsedMs * (SYSCLOCK_FREQ_HZ / 1000);
+    sleepReport.sleepCycles = sleepCyclesSinceReport;
+    sleepReport.totalCycles = totalCycles;
+    sleepReport.activePermille = 1000 - sleepCyclesSinceReport / (totalCycles / 1000);
+    sleepReport.activeCyclesPerIteration =
+        iterationsSinceReport ? (totalCycles - sleepCyclesSinceReport) / iterationsSinceReport : 0;
+    sleepReport.maxControlStepCycles = maxControlStepCyclesSinceReport;
+    sleepCyclesSinceReport = 0;
+    iterationsSinceReport = 0;
+    maxControlStepCyclesSinceReport = 0;
+}
+#endif
 
+/** Sleeps until the next interrupt, see wakeAt */
+static void sleepUntilInterrupt(void) {
+#ifdef MEASURE_SLEEP
+    // the core still wakes up with interrupts masked, but only runs the handler once they're
+    // unmasked, so the time spent in handlers counts as awake. Reading CTRL clears COUNTFLAG.
+    __disable_irq();
+    (void) SysTick->CTRL;
+    uint32_t before = SysTick->VAL;
+    __WFI();
+    uint32_t after = SysTick->VAL;
+    uint32_t wrapped = SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk;
+    __enable_irq();
+    // SysTick counts down, and wraps every 1.4s, which is longer than any sleep
+    sleepCyclesSinceReport += (before - after + (wrapped ? SysTick->LOAD + 1 : 0)) << clockShift;
+#else
+    __WFI();
+#endif
+}
+
+/** How long to stay in STOP mode between samples while the fan is off, well within the IWDG's 1s */
+static const uint32_t STOP_PERIOD_MS = 500;
+
+static volatile uint32_t lptimExpired;
+
+void LPTIM1_IRQHandler(void) {
+    LPTIM->ICR = LPTIM_ICR_ARRMCF;
+    lptimExpired = 1;
+}
+
+/**
+ * Spends STOP_PERIOD_MS in STOP mode, with only the LSI (so the IWDG & LPTIM) running, and then
+ * starts a new block of samples.
+ */
+static void stopUntilLptim(void) {
+    stopAdcConversions();
+    lptimExpired = 0;
+    startLptimOnce(STOP_PERIOD_MS);
+    // anything else that wakes the core up early just goes back to sleep
+    while (!lptimExpired) { enterStopMode(); }
+    stopLptim();
+    addTickMs(STOP_PERIOD_MS);
+#ifdef MEASURE_SLEEP
+    sleepCyclesSinceReport += STOP_PERIOD_MS * (SYSCLOCK_FREQ_HZ / 1000);
+#endif
+    startAdc();
+}
+
+#ifdef CLOCK_SCALING
+#ifdef CONTROL_PWM_SYNC
+#error "CLOCK_SCALING changes TIM1's period, which CONTROL_PWM_SYNC counts its timing in"
+#endif
+/**
+ * While the temperature is steady, or the fan is off, the core has little to do between iterations,
+ * so SYSCLK runs at SYSCLOCK_FREQ_HZ >> CLOCK_LOW_POWER_SHIFT. TIM1 then counts the same 30kHz period
+ * in fewer ticks, at a coarser duty cycle, and the ADC clock prescaler shrinks to keep it at 3MHz.
+ */
+static const uint32_t CLOCK_LOW_POWER_SHIFT = 1;
+
+/**
+ * Switches SYSCLK to SYSCLOCK_FREQ_HZ >> shift. The clock changes right after a TIM1 update event,
+ * which is also when TIM1 loads the new period & compare value from its preload registers, so there
+ * is never a short or long PWM period. The ADC starts over with a fresh block, and the TIM16 count
+ * loses whatever part of a millisecond it was in.
+ */
+static void setClockShift(uint32_t shift) {
+    if (shift == clockShift) { return; }
+    stopAdcConversions();
+    __disable_irq();
+    uint32_t compareValue = TIM1->CCR4 << clockShift;
+    clockShift = shift;
+    SystemCoreClock = SYSCLOCK_FREQ_HZ >> shift;
+#ifdef PWM_DITHER_DMA
+    // the whole pattern in the new ticks, TIM1 starts on it at the update event below
+    setCompareValue(ditherFracTicks);
+    compareValue = ditherPeriodTicks[0];
+#else
+    compareValue = scaleTicks(compareValue);
+#endif
+    TIM1->ARR = ((pwmPeriod + 1) >> shift) - 1;
+    TIM1->CCR4 = compareValue;
+    TIM1->SR = ~TIM_SR_UIF;
+    while (!(TIM1->SR & TIM_SR_UIF)) {}
+    setClockDividers(shift);
+#ifdef ADC_PWM_SYNC
+    // not preloaded, but the counter has only just started the new period
+    TIM1->CCR1 = scaleTicks(ADC_TRIGGER_PHASE_TICKS);
+#endif
+
+    // a new prescaler only takes effect at an update event, which restarts the count
+    uint32_t nowMs = getTickMs();
+    TIM16->PSC = SystemCoreClock / 1000 - 1;
+    TIM16->EGR = TIM_EGR_UG;
+    TIM16->SR = ~TIM_SR_UIF;
+    tickBaseMs = nowMs;
+    __enable_irq();
+    startAdc();
+}
+#endif
+
+/** The last completed block of samples, without waiting for a new one */
+static AdcResults latestAdc(void) {
+#if defined(DMA1)
+    adcReadBlocks = adcCompletedBlocks;
+    const uint16_t *samples = adcCompletedSamples;
     uint32_t allTempCounts = 0;
     uint32_t allFanCounts = 0;
-    static const int NUM_SAMPLES = 64;
-    for (int i = 0; i < NUM_SAMPLES; i++) {
-        // 80us/conversion, 10ms total
-        checkOk(HAL_ADC_PollForConversion(&hadc1, 1));
-        allTempCounts += HAL_ADC_GetValue(&hadc1);
-        checkOk(HAL_ADC_PollForConversion(&hadc1, 1));
-        allFanCounts += HAL_ADC_GetValue(&hadc1);
+    for (int i = 0; i < ADC_NUM_SAMPLES; i++) {
+        allTempCounts += samples[2 * i];
+        allFanCounts += samples[2 * i + 1];
     }
     return (AdcResults){
-        .tempCounts = allTempCounts / NUM_SAMPLES,
-        .fanCounts = allFanCounts / NUM_SAMPLES};
+        .tempSum = allTempCounts,
+        .fanSum = allFanCounts};
+#else
+    // the interrupt can swap the blocks halfway through the copy, and then clear the one being copied
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    adcReadBlocks = adcCompletedBlocks;
+    AdcResults results = adcBlocks[adcFillingBlock ^ 1];
+    __set_PRIMASK(primask);
+    return results;
+#endif
 }
 
+/** Sleeps until there is a block of samples that hasn't been read yet, 10ms at most */
+AdcResults readAdc() {
+    while (adcCompletedBlocks == adcReadBlocks) { sleepUntilInterrupt(); }
+    return latestAdc();
+}
 
-int main(void) {
-    HAL_Init();
-    APP_SystemClockConfig();
-    APP_Watchdog();
-    APP_AdcConfig();
-    APP_PwmOutConfig();
-    SystemCoreClockUpdate();
 
-    const Config config = {
-
-        // 25% min works well for 12V fan
-        // 4% min works well for 24V fan
-        .fanMinDutyCycle = .04,
-        .fanMaxDutyCycle = 1.,
-        .fanSpinupDutyCycle = 1.,
-        .fanSpinupTimeMs = 200,
-
-        // this seems aggressive, but keep in mind the temperature sensor is
-        // generally a little bit away from the temperature-generating
-        // component, which means that the temperature measured is signficantly
-        // cooler
-        .tempMinC = 35,
-        .tempMaxC = 65,
-        .tempHysteresisC = 8,
-    };
-    const PtcThermistorConfig thermistorConfig = PTC_THERMISTOR_10K_3950;
+/** The fan curve, and everything the control loop keeps from one iteration to the next */
+static const AppConfig config = {
+
+    // 25% min works well for 12V fan
+    // 4% min works well for 24V fan
+    .fanMinDutyCycle = CONFIG_VALUE(.04),
+    .fanMaxDutyCycle = CONFIG_VALUE(1.),
+    .fanSpinupDutyCycle = CONFIG_VALUE(1.),
+    .fanSpinupTimeMs = 200,
+
+    // this seems aggressive, but keep in mind the temperature sensor is
+    // generally a little bit away from the temperature-generating
+    // component, which means that the temperature measured is signficantly
+    // cooler
+    .tempMinC = CONFIG_VALUE(35),
+    .tempMaxC = CONFIG_VALUE(65),
+    .tempHysteresisC = CONFIG_VALUE(8),
+
+#ifdef TACH_INPUT
+    // where the fan starts to stall, with a margin, and long enough for TACH_TIMEOUT_MS & TACH_PERIODS
+    .fanMinRpm = 300,
+    .fanStallTimeMs = 3000,
+#endif
+#ifdef PWM_INPUT
+    // the motherboard can ask for more, but not for less than the thermistor does
+    .hostPwmPolicy = HOST_PWM_MAX,
+#endif
+};
+#ifdef USE_FIXED_POINT
+// pick the one matching the supply voltage & fan, see duty_table.h
+static const DutyTable *const DUTY_PROFILE = &DUTY_TABLE_12V_200MA;
+/** DUTY_PROFILE, recomputed for pwmFreqHz & pwmPeriod */
+static DutyTable dutyTable;
+static CountConfig countConfig;
+static CountState state;
+#else
+static const PtcThermistorConfig thermistorConfig = PTC_THERMISTOR_10K_3950;
+static State state;
+#endif
 
-    State state = {
+#ifdef OVERCURRENT_LIMIT
+/** The retry policy after tripOvercurrent, for reading with the debugger */
+static OvercurrentState overcurrent;
+#endif
+
+/**
+ * Recomputes the DCM model for pwmFreqHz & pwmPeriod
+ *
+ * @return the compare value at fanMaxDutyCycle
+ */
+static uint32_t compileDutyModel(void) {
+#ifdef USE_FIXED_POINT
+    compileDutyTable(DUTY_PROFILE, pwmFreqHz, pwmPeriod, &dutyTable);
+    compileCountConfig(&config, TEMP_TABLE_10K_3950, &dutyTable, PWM_DITHER_BITS, &countConfig);
+    return countConfig.maxTicks;
+#else
+    return (uint32_t) (ratioToDcmBuckDutyCycleAt(config.fanMaxDutyCycle, pwmFreqHz) * (pwmPeriod << PWM_DITHER_BITS));
+#endif
+}
+
+/** Sets up the control state, and the ADC with the over-temperature threshold that goes with it */
+static void APP_ControlConfig(void) {
+    uint32_t maxTicks = compileDutyModel();
+#ifdef USE_FIXED_POINT
+    state = (CountState){
+        .state = FAN_OFF,
+        .lastChangeTimeMs = 0,
+        .filteredSum = tempCToAdcSum(Q16(25), TEMP_TABLE_10K_3950) << COUNT_FILTER_FRAC_BITS,
+    };
+    APP_SamplingConfig(countConfig.overTempCounts, maxTicks);
+#else
+    state = (State){
         .state = FAN_OFF,
         .lastChangeTimeMs = 0,
         .lastFilteredTempC = 25.,
     };
+    APP_SamplingConfig(tempCToCounts(config.tempMaxC, &thermistorConfig), maxTicks);
+#endif
+}
+
+#ifdef PWM_INPUT
+/**
+ * The host's PWM duty cycle, as a voltage ratio. Without any edges, it's the level of the pin, which
+ * the pull-up holds high if there's no host. Also recomputes the DCM model when the host's frequency
+ * moves by more than 1/64, or when it comes or goes.
+ */
+static q16_t readHostPwm(void) {
+    uint32_t highTicks = 0;
+    uint32_t periodTicks = readHostPwmTicks(&highTicks);
+    q16_t ratio;
+    if (periodTicks != 0) {
+        ratio = highTicks < periodTicks ? (q16_t) ((highTicks << 16) / periodTicks) : Q16_ONE;
+    } else {
+        periodTicks = SYSCLOCK_FREQ_HZ / PWM_INPUT_FREE_RUN_HZ;
+        ratio = hostPwmPinHigh() ? Q16_ONE : 0;
+    }
+
+    uint32_t difference = periodTicks > pwmPeriod + 1 ? periodTicks - (pwmPeriod + 1) : (pwmPeriod + 1) - periodTicks;
+    if (difference > (pwmPeriod + 1) / 64) {
+        uint32_t fromPeriod = pwmPeriod;
+        pwmFreqHz = SYSCLOCK_FREQ_HZ / periodTicks;
+        pwmPeriod = periodTicks - 1;
+#ifdef PWM_SLEW
+        updatePwmSlewStep();
+#endif
+        // the host's period has changed already, so the compare value can't wait for the DCM model
+        __disable_irq();
+        rescaleCompareValue(fromPeriod);
+        __enable_irq();
+        // only the control loop reads the DCM model, so this takes its milliseconds with interrupts on
+        adcOverTempTicks = compileDutyModel();
+    }
+    return ratio;
+}
+#endif
+
+#if !defined(CONTROL_PWM_SYNC) && !defined(PWM_INPUT)
+static const uint32_t PWM_FREQ_MIN_HZ = 10000;
+/** An ADC_PWM_SYNC conversion pair takes about half a period at 50kHz */
+static const uint32_t PWM_FREQ_MAX_HZ = 50000;
+
+/**
+ * Switches TIM1 to freqHz, clamped to PWM_FREQ_MIN_HZ..PWM_FREQ_MAX_HZ, and recomputes the DCM model
+ * for it. The new period starts at the next update event at the same duty cycle, until the control
+ * loop sets a compare value for it; one in the old ticks could be past the end of the new period.
+ */
+static void setPwmFrequency(uint32_t freqHz) {
+    if (freqHz < PWM_FREQ_MIN_HZ) {
+        freqHz = PWM_FREQ_MIN_HZ;
+    } else if (freqHz > PWM_FREQ_MAX_HZ) {
+        freqHz = PWM_FREQ_MAX_HZ;
+    }
+    if (freqHz == pwmFreqHz) { return; }
+    uint32_t fromPeriod = pwmPeriod;
+    pwmFreqHz = freqHz;
+    pwmPeriod = (SYSCLOCK_FREQ_HZ + freqHz / 2) / freqHz - 1;
+#ifdef PWM_SLEW
+    updatePwmSlewStep();
+#endif
+    // only the control loop reads the DCM model, so this takes its milliseconds with interrupts on
+    uint32_t maxTicks = compileDutyModel();
+
+    __disable_irq();
+    TIM1->ARR = ((pwmPeriod + 1) >> clockShift) - 1;
+    rescaleCompareValue(fromPeriod);
+#ifdef ADC_PWM_SYNC
+    TIM1->CCR1 = scaleTicks(ADC_TRIGGER_PHASE_TICKS);
+#endif
+    adcOverTempTicks = maxTicks;
+    __enable_irq();
+}
+
+/** Write a frequency here with the debugger to switch to it, see setPwmFrequency */
+volatile uint32_t pwmFreqHzRequest = PWM_FREQ_HZ;
+#endif
+
+#ifdef PWM_FREQ_SWEEP
+#ifdef CONTROL_PWM_SYNC
+#error "PWM_FREQ_SWEEP changes TIM1's period, which CONTROL_PWM_SYNC counts its timing in"
+#endif
+static const uint32_t SWEEP_FREQS_HZ[] = {15000, 20000, 25000, PWM_FREQ_HZ, 40000, 50000};
+#define SWEEP_STEPS (sizeof(SWEEP_FREQS_HZ) / sizeof(SWEEP_FREQS_HZ[0]))
+/** How long the fan gets to settle at each frequency, and how many blocks are averaged after that */
+static const uint32_t SWEEP_SETTLE_MS = 2000;
+static const uint32_t SWEEP_BLOCKS = 64;
+
+/** Filled in once by sweepPwmFrequency, for reading with the debugger */
+volatile struct {
+    uint32_t freqHz;
+    /** Average ADC_NUM_SAMPLES sum of FAN_SENSE, the current through the shunt R2 */
+    uint32_t fanSum;
+    /** fanSum relative to the PWM_FREQ_HZ step, in 1/1000 */
+    uint32_t fanCurrentPermille;
+} freqSweepReport[SWEEP_STEPS];
+
+/**
+ * Drives the fan at half the supply voltage, as the DCM model has it, at each of SWEEP_FREQS_HZ,
+ * and measures the current it actually draws through the shunt, averaged by R3/C5. With the supply
+ * fixed, that's the power going in, so wherever the model is off, the current is too. It takes
+ * about 15s, at boot, before the control loop starts.
+ */
+static void sweepPwmFrequency(void) {
+    uint32_t referenceSum = 0;
+    for (uint32_t i = 0; i < SWEEP_STEPS; i++) {
+        setPwmFrequency(SWEEP_FREQS_HZ[i]);
+#ifdef USE_FIXED_POINT
+        setCompareValue(ratioToDcmBuckFracTicksQ16(Q16(.5), &dutyTable, PWM_DITHER_BITS));
+#else
+        setCompareValue((uint32_t) (ratioToDcmBuckDutyCycleAt(.5, pwmFreqHz) * (pwmPeriod << PWM_DITHER_BITS)));
+#endif
+        uint32_t startMs = getTickMs();
+        while (getTickMs() - startMs < SWEEP_SETTLE_MS) {
+            readAdc();
+            refreshWatchdog();
+        }
+        uint32_t fanSum = 0;
+        for (uint32_t block = 0; block < SWEEP_BLOCKS; block++) {
+            fanSum += readAdc().fanSum;
+            refreshWatchdog();
+        }
+        freqSweepReport[i].freqHz = pwmFreqHz;
+        freqSweepReport[i].fanSum = fanSum / SWEEP_BLOCKS;
+        if (SWEEP_FREQS_HZ[i] == PWM_FREQ_HZ) { referenceSum = freqSweepReport[i].fanSum; }
+    }
+    for (uint32_t i = 0; i < SWEEP_STEPS; i++) {
+        freqSweepReport[i].fanCurrentPermille = referenceSum ? freqSweepReport[i].fanSum * 1000 / referenceSum : 0;
+    }
+    setPwmFrequency(PWM_FREQ_HZ);
+}
+#endif
+
+#ifdef RPM_ESTIMATE
+/** Updated by every control iteration that has a new window, for reading with the debugger */
+volatile struct {
+    /** 0 when there's no commutation ripple to go by, e.g. with the fan off */
+    uint32_t rpm;
+    uint32_t estimates;
+} rpmReport;
+
+/**
+ * Estimates the fan speed from the last complete window, if there's a new one. That should be about
+ * 20k cycles, under 2ms at 12MHz, at most once per window (43ms) and once per control period, which
+ * shows up in sleepReport.maxControlStepCycles with MEASURE_SLEEP.
+ */
+static void updateRpmReport(void) {
+    static uint32_t lastWindows = 0;
+    rpmWindowInUse = 1;
+    uint32_t windows = rpmCompletedWindows;
+    if (windows != lastWindows) {
+        lastWindows = windows;
+#ifdef ADC_PWM_SYNC
+        uint32_t sampleRateHz = pwmFreqHz / 2 / RPM_DECIMATION;
+#else
+        uint32_t sampleRateHz = RPM_SCAN_HZ / RPM_DECIMATION;
+#endif
+        rpmReport.rpm = estimateRpm(rpmWindows[rpmFillingWindow ^ 1], sampleRateHz);
+        rpmReport.estimates++;
+    }
+    rpmWindowInUse = 0;
+}
+#endif
+
+#ifdef TACH_OUTPUT
+#if defined(TACH_INPUT) || defined(PWM_INPUT)
+#error "TACH_OUTPUT drives TIM1_CH2, on PB3, which TACH_INPUT & PWM_INPUT capture with"
+#endif
+#if defined(MEASURE_SLEEP) || defined(CLOCK_SCALING)
+#error "TACH_OUTPUT times the tach with SysTick, which MEASURE_SLEEP counts cycles with, and CLOCK_SCALING slows down"
+#endif
+#ifdef CONTROL_PWM_SYNC
+#error "TACH_OUTPUT times the tach with SysTick, which CONTROL_PWM_SYNC times its iterations with"
+#endif
+/** The fan's speed for its voltage, for the tach output, without RPM_ESTIMATE. Measure your fan's. */
+static const TachModel TACH_OUTPUT_MODEL = {
+    .maxRpm = 2000,
+    .stopRatioQ16 = Q16(.2),
+};
+
+/**
+ * TIM1 runs at the PWM frequency, far too fast for a tach: a compare match toggles CH2 every PWM
+ * period, and without a DMA, nothing can move CCR2 out of range in between. TIM16 has no pin on this
+ * package. So CH2 is forced to either level instead, and SysTick interrupts at every toggle, which
+ * takes a dozen cycles.
+ *
+ * Releases the tach output, for a stopped fan.
+ */
+static void releaseTachOutput(void) {
+    MODIFY_REG(TIM1->CCMR1, TIM_CCMR1_OC2M, TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2M_0);
+}
+
+/** Flips the tach output, forced active and forced inactive only differ in the lowest bit of OC2M */
+void SysTick_Handler(void) {
+    TIM1->CCMR1 ^= TIM_CCMR1_OC2M_0;
+}
+
+/**
+ * Sets the tach output to RPM_ESTIMATE's speed, where there's a clear ripple, or to TACH_OUTPUT_MODEL's
+ * speed for ratio otherwise, which is 0 while the fan is off or spins up. A new period takes effect at
+ * the next toggle, so the pulses never glitch.
+ */
+static void updateTachOutput(q16_t ratio) {
+    uint32_t rpm = modelRpm(ratio, &TACH_OUTPUT_MODEL);
+#ifdef RPM_ESTIMATE
+    if (rpmReport.rpm != 0) { rpm = rpmReport.rpm; }
+#endif
+    uint32_t halfPeriodTicks = tachHalfPeriodTicks(rpm, SYSCLOCK_FREQ_HZ);
+    if (halfPeriodTicks == 0) {
+        SysTick->CTRL = 0;
+        SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+        releaseTachOutput();
+        return;
+    }
+    SysTick->LOAD = halfPeriodTicks - 1;
+    if (!(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)) {
+        SysTick->VAL = 0;
+        SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+    }
+}
+#endif
+
+/**
+ * One iteration of the control loop, from a block of samples to the TIM1 compare value.
+ *
+ * @param sampleMs when the block was read
+ * @param elapsedMs how long since the block before it
+ * @param controlPeriodMs how long the last iteration waited for this one
+ * @return how long to wait for the next iteration
+ */
+static uint32_t controlStep(AdcResults adcResults, uint32_t sampleMs, uint32_t elapsedMs, uint32_t controlPeriodMs) {
+#ifdef MEASURE_SLEEP
+    uint32_t startCycles = SysTick->VAL;
+#endif
+#ifdef OVERCURRENT_LIMIT
+    enum OvercurrentAction overcurrentAction = overcurrentStep(overcurrentTrips, sampleMs, &overcurrent);
+    if (overcurrentAction == OVERCURRENT_RETRY) {
+        // from scratch, so that a fan that stalled gets the spinup kick again
+        state.state = FAN_OFF;
+    }
+#endif
+#ifdef TACH_INPUT
+    state.rpm = tachRpm(&tachEdges, sampleMs, SYSCLOCK_FREQ_HZ, &tachState);
+#endif
+#ifdef PWM_INPUT
+#ifdef USE_FIXED_POINT
+    state.hostRatio = readHostPwm();
+#else
+    state.hostRatio = readHostPwm() / 65536.;
+#endif
+#endif
+#ifdef USE_FIXED_POINT
+    int32_t tempSum = (int32_t) adcResults.tempSum;
+    uint32_t compareValue;
+    if (adcOverTemp && (tempSum >> ADC_SAMPLE_BITS) >= countConfig.overTempCounts) {
+        // the watchdog already set the compare value, skip the filter until it cools down
+        compareValue = fanCompareValueOverTemp(tempSum, sampleMs, &countConfig, &state);
+        controlPeriodMs = CONTROL_PERIOD_MIN_MS;
+    } else {
+        if (adcOverTemp) { rearmAdcWatchdog(); }
+        // straight from the ADC sum to timer ticks
+        compareValue = fanCompareValueCountsHeld(tempSum, elapsedMs, sampleMs, &countConfig, &state);
+        controlPeriodMs = nextControlPeriodMsCounts(tempSum, controlPeriodMs, &countConfig, &state);
+    }
+    setCompareValue(compareValue);
+#ifdef TACH_OUTPUT
+    // a fan that's still spinning up isn't turning at the speed of its voltage yet
+    updateTachOutput(state.state == FAN_ON ? state.targetRatio : 0);
+#endif
+#else
+    double tempC = tempSumToC(adcResults.tempSum, ADC_SAMPLE_BITS, &thermistorConfig);
+    double outputRatio;
+    if (adcOverTemp && tempC >= config.tempMaxC) {
+        outputRatio = fanVoltageRatioOverTemp(tempC, sampleMs, &config, &state);
+        controlPeriodMs = CONTROL_PERIOD_MIN_MS;
+    } else {
+        if (adcOverTemp) { rearmAdcWatchdog(); }
+        outputRatio = fanVoltageRatioHeld(tempC, elapsedMs, sampleMs, &config, &state);
+        controlPeriodMs = nextControlPeriodMs(tempC, controlPeriodMs, &state);
+    }
+    double dutyCycle = ratioToDcmBuckDutyCycleAt(outputRatio, pwmFreqHz);
+    setPwmDutyCycle(dutyCycle);
+#ifdef TACH_OUTPUT
+    updateTachOutput(state.state == FAN_ON ? (q16_t) (outputRatio * 65536) : 0);
+#endif
+#endif
+#ifdef OVERCURRENT_LIMIT
+    if (overcurrentAction == OVERCURRENT_RETRY) {
+        enablePwmOutput();
+    } else if (overcurrentAction == OVERCURRENT_WAIT) {
+        // so that the retry isn't late by a whole CONTROL_PERIOD_MAX_MS
+        controlPeriodMs = CONTROL_PERIOD_MIN_MS;
+    }
+#endif
+#ifdef RPM_ESTIMATE
+    updateRpmReport();
+#endif
+#ifdef MEASURE_SLEEP
+    // SysTick counts down, and wraps around at 24 bits
+    uint32_t cycles = (startCycles - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk;
+    if (cycles > maxControlStepCyclesSinceReport) { maxControlStepCyclesSinceReport = cycles; }
+    iterationsSinceReport++;
+#endif
+    return controlPeriodMs;
+}
 
+#ifdef CONTROL_PWM_SYNC
+/** Width of the controlTiming.startLatency bins, 1us */
+#define CONTROL_LATENCY_BIN_TICKS (SYSCLOCK_FREQ_HZ / 1000000)
+#define CONTROL_LATENCY_BINS 16
+/** SysTick ticks from one TIM1 update event to the next, both count at the core clock */
+#define CONTROL_UPDATE_TICKS ((uint32_t) CONTROL_UPDATE_PERIODS * (PWM_PERIOD + 1))
+
+/** Updated by every control iteration, for reading with the debugger */
+volatile struct {
+    uint32_t iterations;
+    /** How long after its TIM1 update event each iteration started, in 1us bins, the last one counts anything later */
+    uint32_t startLatency[CONTROL_LATENCY_BINS];
+    /** Iterations that were still running when the next one was due, CONTROL_PERIOD_MIN_MS later */
+    uint32_t overruns;
+} controlTiming;
+
+/** SysTick time of the last TIM1 update event, see startControlInterrupt */
+static uint32_t controlUpdateTicks;
+
+/** SysTick, counting up instead of down */
+static uint32_t sysTickNow(void) {
+    return SysTick_LOAD_RELOAD_Msk - SysTick->VAL;
+}
+
+void TIM1_BRK_UP_TRG_COM_IRQHandler(void) {
+    static int updates = 0;
+    uint32_t startTicks = sysTickNow();
+    TIM1->SR = ~TIM_SR_UIF;
+    // SysTick wraps around at 24 bits, every 1.4s. An update event that came while the one before it
+    // was still pending got lost, so skip past that too.
+    controlUpdateTicks += CONTROL_UPDATE_TICKS;
+    while (((startTicks - controlUpdateTicks) & SysTick_LOAD_RELOAD_Msk) >= CONTROL_UPDATE_TICKS) {
+        controlUpdateTicks += CONTROL_UPDATE_TICKS;
+    }
+    if (++updates < CONTROL_UPDATE_DECIMATION) { return; }
+    updates = 0;
+
+    uint32_t bin = ((startTicks - controlUpdateTicks) & SysTick_LOAD_RELOAD_Msk) / CONTROL_LATENCY_BIN_TICKS;
+    controlTiming.startLatency[bin < CONTROL_LATENCY_BINS ? bin : CONTROL_LATENCY_BINS - 1]++;
+    controlTiming.iterations++;
+
+    // the period is always the same, so no need for the adaptive rate
+    controlStep(latestAdc(), getTickMs(), CONTROL_PERIOD_MIN_MS, CONTROL_PERIOD_MIN_MS);
+    refreshWatchdog();
+
+    // the update event in between only gets counted, it's the one after that this one mustn't run into
+    uint32_t sinceUpdateTicks = (sysTickNow() - controlUpdateTicks) & SysTick_LOAD_RELOAD_Msk;
+    if (sinceUpdateTicks >= CONTROL_UPDATE_DECIMATION * CONTROL_UPDATE_TICKS) { controlTiming.overruns++; }
+}
+
+/**
+ * Starts running controlStep from the TIM1 update interrupt, below the ADC's priority. The update
+ * events come exactly CONTROL_UPDATE_TICKS apart, so timestamping one with SysTick places all of them.
+ */
+static void startControlInterrupt(void) {
+    // SysTick doesn't keep the time anymore, and MEASURE_SLEEP or TACH_INPUT may run it already
+    if (!(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)) {
+        SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+        SysTick->VAL = 0;
+        SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+    }
+    TIM1->SR = ~TIM_SR_UIF;
+    while (!(TIM1->SR & TIM_SR_UIF)) {}
+    // the interrupt adds the first CONTROL_UPDATE_TICKS at the next one
+    controlUpdateTicks = sysTickNow();
+    TIM1->SR = ~TIM_SR_UIF;
+    NVIC_SetPriority(TIM1_BRK_UP_TRG_COM_IRQn, PRIORITY_LOW);
+    NVIC_EnableIRQ(TIM1_BRK_UP_TRG_COM_IRQn);
+    TIM1->DIER |= TIM_DIER_UIE;
+}
+#endif
+
+int main(void) {
+    APP_SystemClockConfig();
+    APP_Watchdog();
+    APP_LptimConfig();
+#ifdef MEASURE_SLEEP
+    APP_SleepMeasurementConfig();
+#endif
+#ifdef CONTROL_PWM_SYNC
+    APP_PwmOutConfig(CONTROL_UPDATE_PERIODS);
+#else
+    APP_PwmOutConfig(1);
+#endif
+#ifdef ADC_PWM_SYNC
+    TIM1->CCR1 = ADC_TRIGGER_PHASE_TICKS;
+#endif
+#ifdef TACH_INPUT
+    APP_TachTimestampConfig();
+    APP_TachConfig();
+#endif
+#ifdef PWM_INPUT
+    pwmFreqHz = PWM_INPUT_FREE_RUN_HZ;
+    pwmPeriod = SYSCLOCK_FREQ_HZ / PWM_INPUT_FREE_RUN_HZ - 1;
+    APP_PwmInputConfig(pwmPeriod);
+#endif
+#ifdef TACH_OUTPUT
+    APP_TachOutputConfig();
+#endif
+#ifdef PWM_DITHER_DMA
+    APP_PwmDitherConfig(ditherPeriodTicks, PWM_DITHER_PERIODS);
+#elif defined(PWM_UPDATE_INTERRUPT)
+    APP_PwmUpdateConfig();
+#endif
+    SystemCoreClockUpdate();
+    APP_ControlConfig();
+#ifdef PWM_FREQ_SWEEP
+    sweepPwmFrequency();
+#endif
+
+#ifdef CONTROL_PWM_SYNC
+    // TIM1 runs the show, and it doesn't run in STOP mode, so always stay in sleep mode
+    startControlInterrupt();
+    while (1) {
+        sleepUntilInterrupt();
+#ifdef MEASURE_SLEEP
+        updateSleepReport();
+#endif
+    }
+#else
+    uint32_t controlPeriodMs = CONTROL_PERIOD_MIN_MS;
+    uint32_t lastSampleMs = getTickMs() - CONTROL_PERIOD_MIN_MS;
     while (1) {
-        uint32_t startTime = HAL_GetTick();
+        uint32_t startTime = getTickMs();
         AdcResults adcResults = readAdc();
+        // the filter takes each sample in for all the time since the one before it
+        uint32_t sampleMs = getTickMs();
+        uint32_t elapsedMs = sampleMs - lastSampleMs;
+        lastSampleMs = sampleMs;
+#ifndef PWM_INPUT
+        if (pwmFreqHzRequest != pwmFreqHz) {
+            setPwmFrequency(pwmFreqHzRequest);
+            pwmFreqHzRequest = pwmFreqHz;
+        }
+#endif
+        controlPeriodMs = controlStep(adcResults, sampleMs, elapsedMs, controlPeriodMs);
+#ifdef CLOCK_SCALING
+        // full speed only while the temperature is changing, or it's too hot
+        setClockShift(state.state == FAN_OFF || controlPeriodMs > CONTROL_PERIOD_MIN_MS ? CLOCK_LOW_POWER_SHIFT : 0);
+#endif
 
-        double tempC = tempCountsToC(adcResults.tempCounts, &thermistorConfig);
-        double outputRatio = fanVoltageRatio(tempC, HAL_GetTick(), &config, &state);
-        double dutyCycle = ratioToDcmBuckDutyCycle(outputRatio);
-        setPwmDutyCycle(dutyCycle);
-
-        // 10ms per loop (will mess up at 49-day uptime rollover, but that's ok)
-        uint32_t elapsed = HAL_GetTick() - startTime;
-        if (elapsed < 10) {
-            HAL_Delay(10 - elapsed);
+        if (state.state == FAN_OFF && !adcOverTemp) {
+            // nothing to do until it warms up, so sample much less often, from STOP mode
+            stopUntilLptim();
+        } else {
+            // asleep until this period is over, which is anywhere from 10ms while things are
+            // changing, to 640ms when they're not. The spinup time & IWDG refresh only matter at
+            // the end of a period, so that's the only deadline.
+            while (getTickMs() - startTime < controlPeriodMs) {
+                wakeAt(startTime + controlPeriodMs);
+                sleepUntilInterrupt();
+            }
         }
-        HAL_IWDG_Refresh(&hiwdg);
+        refreshWatchdog();
+#ifdef MEASURE_SLEEP
+        updateSleepReport();
+#endif
     }
+#endif
 }
@@ -0,0 +1,24 @@
+#include "overcurrent.h"
+
+enum OvercurrentAction overcurrentStep(uint32_t trips, uint32_t currentMs, OvercurrentState *state) {
+    if (trips != state->seenTrips) {
+        state->seenTrips = trips;
+        state->lastTripMs = currentMs;
+        state->outputOff = 1;
+        if (state->tripsInRow > 0 && currentMs - state->lastRetryMs >= OVERCURRENT_CLEAR_MS) {
+            // the last retry ran long enough, so this is a new fault
+            state->tripsInRow = 0;
+        }
+        if (++state->tripsInRow > OVERCURRENT_MAX_RETRIES) { state->lockedOut = 1; }
+    }
+    if (state->lockedOut) {
+        return OVERCURRENT_LOCKED_OUT;
+    } else if (!state->outputOff) {
+        return OVERCURRENT_RUN;
+    } else if (currentMs - state->lastTripMs < (uint32_t) OVERCURRENT_RETRY_MS << (state->tripsInRow - 1)) {
+        return OVERCURRENT_WAIT;
+    }
+    state->outputOff = 0;
+    state->lastRetryMs = currentMs;
+    return OVERCURRENT_RETRY;
+}
@@ -0,0 +1,44 @@
+#ifndef FIRMWARE_OVERCURRENT_H
+#define FIRMWARE_OVERCURRENT_H
+
+#include "stdint.h"
+
+/** What the control loop does about overcurrent trips, see overcurrentStep */
+enum OvercurrentAction {
+    /** No trip, the output is on */
+    OVERCURRENT_RUN,
+    /** The output is off after a trip, until the retry delay is over */
+    OVERCURRENT_WAIT,
+    /** Turn the output back on, and spin the fan up from scratch */
+    OVERCURRENT_RETRY,
+    /** Too many trips in a row, the output stays off until a reset */
+    OVERCURRENT_LOCKED_OUT,
+};
+
+/** The first retry comes this long after a trip, and every further one in a row twice as long */
+#define OVERCURRENT_RETRY_MS 100
+/** More trips in a row than this lock the output out */
+#define OVERCURRENT_MAX_RETRIES 5
+/** A retry that runs this long without tripping again ends the row */
+#define OVERCURRENT_CLEAR_MS 10000
+
+typedef struct {
+    /** The trip count that the last call saw */
+    uint32_t seenTrips;
+    uint32_t lastTripMs;
+    uint32_t lastRetryMs;
+    /** Trips in a row, without OVERCURRENT_CLEAR_MS of running in between */
+    uint32_t tripsInRow;
+    int outputOff;
+    int lockedOut;
+} OvercurrentState;
+
+/**
+ * Retry policy after the hardware cut the output, with exponential backoff
+ *
+ * @param trips how many times the output was cut so far, counted by the interrupt
+ */
+enum OvercurrentAction overcurrentStep(uint32_t trips, uint32_t currentMs, OvercurrentState *state);
+
+
+#endif//FIRMWARE_OVERCURRENT_H
@@ -0,0 +1,105 @@
+#ifndef FIRMWARE_PERIPHERALS_H
+#define FIRMWARE_PERIPHERALS_H
+
+#include "py32f0xx.h"
+#include "stdint.h"
+
+/**
+ * Setting up the peripherals, with HAL in peripherals_hal.c, or with LL in peripherals_ll.c for
+ * USE_LL_LIB. Once they're running, main.c works on the registers directly, interrupts included,
+ * which is the same code with either library.
+ */
+
+#ifdef USE_FULL_LL_DRIVER
+// py32f0xx_hal_conf.h only comes with HAL, so these are the same as there
+#define PRIORITY_HIGHEST 0
+#define PRIORITY_HIGH 1
+#define PRIORITY_LOW 2
+#define PRIORITY_LOWEST 3
+#define STATUS_OK SUCCESS
+#else
+#define STATUS_OK HAL_OK
+#endif
+
+/** Stops in the debugger, or waits for the IWDG to reset, when HAL or LL reports an error */
+void checkOk(int ok);
+
+/** Milliseconds since boot, from main.c, which HAL's timeouts use too */
+uint32_t getTickMs(void);
+/** Adds time that TIM16 didn't count to getTickMs, from main.c */
+void addTickMs(uint32_t ms);
+
+/**
+ * SYSCLK at SYSCLOCK_FREQ_HZ from the HSI, the LSI for the IWDG & LPTIM, and the tickless timebase:
+ * TIM16 counting milliseconds, with only its update interrupt on
+ */
+void APP_SystemClockConfig(void);
+
+/** The IWDG, resetting after 1s */
+void APP_Watchdog(void);
+void refreshWatchdog(void);
+
+/**
+ * The ADC scanning TEMP_SENSE (PA3) & FAN_SENSE (PA4), continuously or at TIM1's TRGO with
+ * ADC_PWM_SYNC, with the analog watchdog interrupt at overTempCounts on TEMP_SENSE, and the
+ * end-of-conversion interrupt when there's no DMA
+ */
+void APP_AdcConfig(uint32_t overTempCounts);
+/** DMA channel 1 going around samples, which holds length conversions, with both its interrupts */
+void APP_AdcDmaConfig(uint16_t *samples, uint32_t length);
+/** Starts converting from the first channel, and the DMA from the start of its samples */
+void startAdcConversions(void);
+/** Waits for the current conversion, and disables the ADC, and its DMA */
+void stopAdcConversions(void);
+
+/**
+ * Switches the HSI divider, and the ADC clock prescaler with it, for SYSCLOCK_FREQ_HZ >> shift, see
+ * setClockShift
+ */
+void setClockDividers(uint32_t shift);
+
+/**
+ * TIM1 counting PWM_PERIOD at SYSCLOCK_FREQ_HZ, with CH4 on PA1 (pin 7) at 0% duty cycle, an
+ * update event every updatePeriods periods, and the period & compare value preloaded for it. With
+ * ADC_PWM_SYNC, CH1 sends the ADC trigger on TRGO at its compare value, and with OVERCURRENT_LIMIT,
+ * a break forces PA1 low.
+ */
+void APP_PwmOutConfig(uint32_t updatePeriods);
+
+/**
+ * The tach wire on pin 4, PB3, TIM1_CH2, which is SWCLK on the programming header, so PA14 lets go
+ * of it. Every falling edge is captured, through a filter of 8 core clocks, 0.67us, against the
+ * switching noise. It's that short so that it doesn't swallow a short on-time.
+ */
+void APP_TachConfig(void);
+
+/**
+ * The host PWM signal on pin 4, PB3, TIM1_CH2, which is SWCLK on the programming header, so PA14
+ * lets go of it. The only timer with a capture channel on a free pin is TIM1, so in PWM input mode,
+ * TIM1 restarts at every rising edge, with the period in CCR2 and the high time in CCR1, all without
+ * the CPU. Without a host signal, TIM1 runs at period.
+ */
+void APP_PwmInputConfig(uint32_t period);
+
+/** DMA channel 2 copying pattern, of length compare values, into CCR4 at every TIM1 update event */
+void APP_PwmDitherConfig(const uint16_t *pattern, uint32_t length);
+
+/**
+ * The LPTIM at LSI / 128, 32.768kHz / 128 = 256Hz, with its interrupt, which wakes the core from
+ * STOP through EXTI line 29
+ */
+void APP_LptimConfig(void);
+/** Starts the LPTIM once, to interrupt after ms */
+void startLptimOnce(uint32_t ms);
+/** Goes into STOP mode with the low-power regulator, until an interrupt */
+void enterStopMode(void);
+void stopLptim(void);
+
+/**
+ * The tach output on pin 4, PB3, TIM1_CH2, which is SWCLK on the programming header, so PA14 lets
+ * go of it. It's open drain, like a fan's tach, for the host's pull-up, which mustn't go above VCC.
+ * CH2 is forced to either level, starting released, and SysTick interrupts at PRIORITY_LOW.
+ */
+void APP_TachOutputConfig(void);
+
+#endif//FIRMWARE_PERIPHERALS_H
@@ -0,0 +1,447 @@
+#ifdef USE_HAL_DRIVER
+#include "logic.h"
+#include "peripherals.h"
+
+/**
+ * Tickless timebase: instead of a 1kHz SysTick interrupt, TIM16 counts milliseconds by itself, see
+ * getTickMs in main.c
+ */
+TIM_HandleTypeDef htim16 = {
+    .Instance = TIM16,
+    .Init = {
+        .Period = 0xffff,
+        .ClockDivision = TIM_CLOCKDIVISION_DIV1,
+        .CounterMode = TIM_COUNTERMODE_UP,
+        .RepetitionCounter = 0,
+        .AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE,
+    },
+};
+
+/** Called by HAL_Init and HAL_RCC_ClockConfig, with SystemCoreClock already updated */
+HAL_StatusTypeDef HAL_InitTick(uint32_t TickPriority) {
+    __HAL_RCC_TIM16_CLK_ENABLE();
+    htim16.Init.Prescaler = SystemCoreClock / 1000 - 1;
+    // loading the new prescaler restarts the counter, so keep the time counted so far
+    addTickMs(htim16.Instance->CNT);
+    if (HAL_TIM_Base_Init(&htim16) != HAL_OK) { return HAL_ERROR; }
+    __HAL_TIM_CLEAR_FLAG(&htim16, TIM_FLAG_UPDATE);
+    HAL_NVIC_SetPriority(TIM16_IRQn, TickPriority, 0);
+    HAL_NVIC_EnableIRQ(TIM16_IRQn);
+    return HAL_TIM_Base_Start_IT(&htim16);
+}
+
+/** HAL's timeouts use the same timebase */
+uint32_t HAL_GetTick(void) {
+    return getTickMs();
+}
+
+void APP_SystemClockConfig(void) {
+    HAL_Init();
+    /** use internal oscillator, sysclk = 16MHz */
+    checkOk(HAL_RCC_OscConfig(&(RCC_OscInitTypeDef){
+        .OscillatorType = RCC_OSCILLATORTYPE_HSI,
+        .HSIState = RCC_HSI_ON,
+        .HSIDiv = RCC_HSI_DIV2, /* 12MHz */
+        .HSICalibrationValue = RCC_HSICALIBRATION_24MHz,
+    }));
+    // make sure we have a LSI for the watchdog
+    checkOk(HAL_RCC_OscConfig(&(RCC_OscInitTypeDef){
+        .OscillatorType = RCC_OSCILLATORTYPE_LSI,
+        .LSIState = RCC_LSI_ON,
+    }));
+
+    checkOk(HAL_RCC_ClockConfig(
+        &(RCC_ClkInitTypeDef){
+            .ClockType = RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_SYSCLK | RCC_CLOCKTYPE_PCLK1,
+            .SYSCLKSource = RCC_SYSCLKSOURCE_HSI, /* SYSCLK source */
+            .AHBCLKDivider = RCC_SYSCLK_DIV1,
+        },
+        FLASH_LATENCY_0));// latency 0 for <= 24MHz
+}
+
+// uses LSI clock, 32kHz
+IWDG_HandleTypeDef hiwdg = {
+    .Instance = IWDG,
+    .Init = {
+        .Prescaler = IWDG_PRESCALER_256,
+        .Reload = 125,// 1s
+    },
+};
+
+void APP_Watchdog(void) {
+    checkOk(HAL_IWDG_Init(&hiwdg));
+    HAL_IWDG_Refresh(&hiwdg);
+}
+
+void refreshWatchdog(void) {
+    HAL_IWDG_Refresh(&hiwdg);
+}
+
+ADC_HandleTypeDef hadc1 = {
+    .Instance = ADC1,
+    .Init = (ADC_InitTypeDef){
+        .ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4,            /* Analog ADC clock source is PCLK*/
+        .Resolution = ADC_RESOLUTION_12B,                      /* conversion resolution 12bit*/
+        .DataAlign = ADC_DATAALIGN_RIGHT,                      /* data right alignment */
+        .ScanConvMode = ADC_SCAN_DIRECTION_FORWARD,            /* scan sequence direction: up (from channel 0 to channel 11)*/
+        .EOCSelection = ADC_EOC_SINGLE_CONV,                   /* ADC_EOC_SINGLE_CONV: single sampling, ADC_EOC_SEQ_CONV: sequence sampling*/
+        .LowPowerAutoWait = DISABLE,                           /* ENABLE=After reading the ADC value, start the next conversion , DISABLE=Direct conversion, must be DISABLE with interrupts/DMA */
+#ifdef ADC_PWM_SYNC
+        .ContinuousConvMode = DISABLE,                            /* wait for TIM1 */
+        .DiscontinuousConvMode = ENABLE,                          /* one channel per trigger, alternating */
+        .ExternalTrigConv = ADC_EXTERNALTRIGCONV_T1_TRGO,         /* TIM1 compare 1, see ADC_TRIGGER_PHASE_TICKS */
+        .ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING,  /* trigger on the compare pulse */
+        .Overrun = ADC_OVR_DATA_OVERWRITTEN,                      /* ADC_OVR_DATA_OVERWRITTEN=overrun when overloaded, ADC_OVR_DATA_PRESERVED=keep old value*/
+        .SamplingTimeCommon = ADC_SAMPLETIME_41CYCLES_5,          /* 14us sampling + 4us conversion, fits in one 33us PWM period */
+#else
+        .ContinuousConvMode = ENABLE,                          /* scan TEMP_SENSE & FAN_SENSE over and over */
+        .DiscontinuousConvMode = DISABLE,                      /* Disable discontinuous mode */
+        .ExternalTrigConv = ADC_SOFTWARE_START,                /* software trigger */
+        .ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE, /* No trigger edge */
+        .Overrun = ADC_OVR_DATA_OVERWRITTEN,                   /* ADC_OVR_DATA_OVERWRITTEN=overrun when overloaded, ADC_OVR_DATA_PRESERVED=keep old value*/
+        .SamplingTimeCommon = ADC_SAMPLETIME_239CYCLES_5,      /* channel sampling time is 239.5ADC clock cycle */
+#endif
+#if defined(DMA1)
+        .DMAContinuousRequests = ENABLE, /* keep going around the circular buffer */
+#endif
+    },
+};
+
+void APP_AdcConfig(uint32_t overTempCounts) {
+    __HAL_RCC_ADC_FORCE_RESET();
+    __HAL_RCC_ADC_RELEASE_RESET(); /* Reset ADC */
+    __HAL_RCC_ADC_CLK_ENABLE();    /* Enable ADC clock */
+
+    // PA3 is TEMP_SENSE
+    HAL_GPIO_Init(
+        GPIOA,
+        &(GPIO_InitTypeDef){
+            .Mode = GPIO_MODE_ANALOG,
+            .Pin = GPIO_PIN_3});
+    // PA4 is FAN_SENSE
+    HAL_GPIO_Init(
+        GPIOA,
+        &(GPIO_InitTypeDef){
+            .Mode = GPIO_MODE_ANALOG,
+            .Pin = GPIO_PIN_4});
+
+    checkOk(HAL_ADC_Calibration_Start(&hadc1));
+    checkOk(HAL_ADC_Init(&hadc1));
+    checkOk(HAL_ADC_ConfigChannel(&hadc1, &(ADC_ChannelConfTypeDef){
+                                              .Rank = ADC_RANK_CHANNEL_NUMBER,
+                                              .Channel = ADC_CHANNEL_3,
+                                          }));
+    checkOk(HAL_ADC_ConfigChannel(&hadc1, &(ADC_ChannelConfTypeDef){
+                                              .Rank = ADC_RANK_CHANNEL_NUMBER,
+                                              .Channel = ADC_CHANNEL_4,
+                                          }));
+    checkOk(HAL_ADC_AnalogWDGConfig(&hadc1, &(ADC_AnalogWDGConfTypeDef){
+                                                .WatchdogMode = ADC_ANALOGWATCHDOG_SINGLE_REG,
+                                                .Channel = ADC_CHANNEL_3,
+                                                .ITMode = ENABLE,
+                                                .HighThreshold = overTempCounts - 1,
+                                                .LowThreshold = 0,
+                                            }));
+    HAL_NVIC_SetPriority(ADC_COMP_IRQn, PRIORITY_HIGH, 0);
+    HAL_NVIC_EnableIRQ(ADC_COMP_IRQn);
+#if !defined(DMA1)
+    __HAL_ADC_ENABLE_IT(&hadc1, ADC_IT_EOC);
+#endif
+}
+
+#if defined(DMA1)
+DMA_HandleTypeDef hdma1 = {
+    .Instance = DMA1_Channel1,
+    .Init = {
+        .Direction = DMA_PERIPH_TO_MEMORY,
+        .PeriphInc = DMA_PINC_DISABLE,
+        .MemInc = DMA_MINC_ENABLE,
+        .PeriphDataAlignment = DMA_PDATAALIGN_WORD,
+        .MemDataAlignment = DMA_MDATAALIGN_HALFWORD,
+        .Mode = DMA_CIRCULAR,
+        .Priority = DMA_PRIORITY_HIGH,
+    },
+};
+
+/** The DMA's circle, for startAdcConversions */
+static uint16_t *adcDmaSamples;
+static uint32_t adcDmaLength;
+
+void APP_AdcDmaConfig(uint16_t *samples, uint32_t length) {
+    adcDmaSamples = samples;
+    adcDmaLength = length;
+    __HAL_RCC_DMA_CLK_ENABLE();
+    __HAL_RCC_SYSCFG_CLK_ENABLE();
+    HAL_SYSCFG_DMA_Req(DMA_CHANNEL_MAP_ADC);
+    checkOk(HAL_DMA_Init(&hdma1));
+    __HAL_LINKDMA(&hadc1, DMA_Handle, hdma1);
+    HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, PRIORITY_HIGH, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+}
+#endif
+
+void startAdcConversions(void) {
+#if defined(DMA1)
+    checkOk(HAL_ADC_Start_DMA(&hadc1, (uint32_t *) adcDmaSamples, adcDmaLength));
+#else
+    checkOk(HAL_ADC_Start(&hadc1));
+#endif
+}
+
+void stopAdcConversions(void) {
+#if defined(DMA1)
+    checkOk(HAL_ADC_Stop_DMA(&hadc1));
+#else
+    checkOk(HAL_ADC_Stop(&hadc1));
+#endif
+}
+
+#ifdef CLOCK_SCALING
+/** HSI dividers & ADC clock prescalers, for each clockShift */
+static const uint32_t HSI_DIVIDERS[] = {RCC_HSI_DIV2, RCC_HSI_DIV4, RCC_HSI_DIV8};
+static const uint32_t ADC_CLOCKS[] = {ADC_CLOCK_SYNC_PCLK_DIV4, ADC_CLOCK_SYNC_PCLK_DIV2, ADC_CLOCK_SYNC_PCLK_DIV1};
+
+void setClockDividers(uint32_t shift) {
+    __HAL_RCC_HSI_CONFIG(HSI_DIVIDERS[shift]);
+    hadc1.Init.ClockPrescaler = ADC_CLOCKS[shift];
+    MODIFY_REG(hadc1.Instance->CFGR2, ADC_CFGR2_CKMODE, hadc1.Init.ClockPrescaler);
+}
+#endif
+
+TIM_HandleTypeDef htim1 = {
+    .Instance = TIM1,
+    .Init = {
+        .Period = PWM_PERIOD,
+        .Prescaler = 0,
+        .ClockDivision = TIM_CLOCKDIVISION_DIV1,
+        .CounterMode = TIM_COUNTERMODE_UP,
+        .AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE, /* the period only changes at an update event */
+    },
+};
+
+void APP_PwmOutConfig(uint32_t updatePeriods) {
+    __HAL_RCC_TIM1_CLK_ENABLE();
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+
+    // PWM output 200kHz
+    // Pin 7, PA1, TIM1_CH4
+    HAL_GPIO_Init(
+        GPIOA,
+        &(GPIO_InitTypeDef){
+            .Mode = GPIO_MODE_AF_PP,
+            .Pull = GPIO_PULLUP,
+            .Speed = GPIO_SPEED_FREQ_HIGH,
+            .Pin = GPIO_PIN_1,
+            .Alternate = GPIO_AF13_TIM1,
+        });
+
+    htim1.Init.RepetitionCounter = updatePeriods - 1;
+    checkOk(HAL_TIM_Base_Init(&htim1));
+    checkOk(HAL_TIM_PWM_ConfigChannel(
+        &htim1,
+        &(TIM_OC_InitTypeDef){
+            .OCMode = TIM_OCMODE_PWM1,
+            .OCFastMode = TIM_OCFAST_DISABLE,
+            .OCPolarity = TIM_OCPOLARITY_HIGH,
+            .OCNPolarity = TIM_OCNPOLARITY_LOW,
+            .OCIdleState = TIM_OCIDLESTATE_RESET,
+            .OCNIdleState = TIM_OCNIDLESTATE_RESET,
+            .Pulse = 0,// duty cycle = 0%
+        },
+        TIM_CHANNEL_4));
+#ifdef ADC_PWM_SYNC
+    // channel 1 isn't connected to a pin, it only sends a pulse on TRGO to start the ADC
+    checkOk(HAL_TIM_OC_ConfigChannel(
+        &htim1,
+        &(TIM_OC_InitTypeDef){
+            .OCMode = TIM_OCMODE_TIMING,
+            .Pulse = 0,
+        },
+        TIM_CHANNEL_1));
+    checkOk(HAL_TIMEx_MasterConfigSynchronization(
+        &htim1,
+        &(TIM_MasterConfigTypeDef){
+            .MasterOutputTrigger = TIM_TRGO_OC1,
+            .MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE,
+        }));
+    checkOk(HAL_TIM_OC_Start(&htim1, TIM_CHANNEL_1));
+#endif
+#ifdef OVERCURRENT_LIMIT
+    // a break clears MOE, which forces PA1 to its idle state, low, until the control loop sets it again
+    checkOk(HAL_TIMEx_ConfigBreakDeadTime(
+        &htim1,
+        &(TIM_BreakDeadTimeConfigTypeDef){
+            .OffStateRunMode = TIM_OSSR_DISABLE,
+            .OffStateIDLEMode = TIM_OSSI_ENABLE,
+            .LockLevel = TIM_LOCKLEVEL_OFF,
+            .DeadTime = 0,
+            .BreakState = TIM_BREAK_ENABLE,
+            .BreakPolarity = TIM_BREAKPOLARITY_HIGH,
+            .BreakFilter = 0,
+            .AutomaticOutput = TIM_AUTOMATICOUTPUT_DISABLE,
+        }));
+#endif
+    checkOk(HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_4));
+}
+
+void APP_TachConfig(void) {
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    HAL_GPIO_Init(GPIOA, &(GPIO_InitTypeDef){.Mode = GPIO_MODE_ANALOG, .Pull = GPIO_NOPULL, .Pin = GPIO_PIN_14});
+    // the tach is open collector
+    HAL_GPIO_Init(
+        GPIOB,
+        &(GPIO_InitTypeDef){
+            .Mode = GPIO_MODE_AF_PP,
+            .Pull = GPIO_PULLUP,
+            .Speed = GPIO_SPEED_FREQ_LOW,
+            .Pin = GPIO_PIN_3,
+            .Alternate = GPIO_AF1_TIM1,
+        });
+    checkOk(HAL_TIM_IC_ConfigChannel(
+        &htim1,
+        &(TIM_IC_InitTypeDef){
+            .ICPolarity = TIM_ICPOLARITY_FALLING,
+            .ICSelection = TIM_ICSELECTION_DIRECTTI,
+            .ICPrescaler = TIM_ICPSC_DIV1,
+            .ICFilter = 0x3,// fCK_INT, N = 8
+        },
+        TIM_CHANNEL_2));
+    TIM_CCxChannelCmd(htim1.Instance, TIM_CHANNEL_2, TIM_CCx_ENABLE);
+    HAL_NVIC_SetPriority(TIM1_CC_IRQn, PRIORITY_HIGH, 0);
+    HAL_NVIC_EnableIRQ(TIM1_CC_IRQn);
+    __HAL_TIM_ENABLE_IT(&htim1, TIM_IT_CC2);
+}
+
+void APP_PwmInputConfig(uint32_t period) {
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    HAL_GPIO_Init(GPIOA, &(GPIO_InitTypeDef){.Mode = GPIO_MODE_ANALOG, .Pull = GPIO_NOPULL, .Pin = GPIO_PIN_14});
+    // the host's output is open drain, and the fan runs at full speed if it's not connected
+    HAL_GPIO_Init(
+        GPIOB,
+        &(GPIO_InitTypeDef){
+            .Mode = GPIO_MODE_AF_PP,
+            .Pull = GPIO_PULLUP,
+            .Speed = GPIO_SPEED_FREQ_LOW,
+            .Pin = GPIO_PIN_3,
+            .Alternate = GPIO_AF1_TIM1,
+        });
+    checkOk(HAL_TIM_IC_ConfigChannel(
+        &htim1,
+        &(TIM_IC_InitTypeDef){
+            .ICPolarity = TIM_ICPOLARITY_RISING,
+            .ICSelection = TIM_ICSELECTION_DIRECTTI,
+            .ICPrescaler = TIM_ICPSC_DIV1,
+            .ICFilter = 0x3,// fCK_INT, N = 8
+        },
+        TIM_CHANNEL_2));
+    checkOk(HAL_TIM_IC_ConfigChannel(
+        &htim1,
+        &(TIM_IC_InitTypeDef){
+            .ICPolarity = TIM_ICPOLARITY_FALLING,
+            .ICSelection = TIM_ICSELECTION_INDIRECTTI,
+            .ICPrescaler = TIM_ICPSC_DIV1,
+            .ICFilter = 0x3,
+        },
+        TIM_CHANNEL_1));
+    checkOk(HAL_TIM_SlaveConfigSynchro(
+        &htim1,
+        &(TIM_SlaveConfigTypeDef){
+            .SlaveMode = TIM_SLAVEMODE_RESET,
+            .InputTrigger = TIM_TS_TI2FP2,
+            .TriggerPolarity = TIM_TRIGGERPOLARITY_RISING,
+            .TriggerFilter = 0x3,
+        }));
+    TIM_CCxChannelCmd(htim1.Instance, TIM_CHANNEL_1, TIM_CCx_ENABLE);
+    TIM_CCxChannelCmd(htim1.Instance, TIM_CHANNEL_2, TIM_CCx_ENABLE);
+    __HAL_TIM_SET_AUTORELOAD(&htim1, period);
+}
+
+#if defined(DMA1)
+DMA_HandleTypeDef hdma2 = {
+    .Instance = DMA1_Channel2,
+    .Init = {
+        .Direction = DMA_MEMORY_TO_PERIPH,
+        .PeriphInc = DMA_PINC_DISABLE,
+        .MemInc = DMA_MINC_ENABLE,
+        .PeriphDataAlignment = DMA_PDATAALIGN_WORD,
+        .MemDataAlignment = DMA_MDATAALIGN_HALFWORD,
+        .Mode = DMA_CIRCULAR,
+        .Priority = DMA_PRIORITY_LOW,
+    },
+};
+
+void APP_PwmDitherConfig(const uint16_t *pattern, uint32_t length) {
+    __HAL_RCC_DMA_CLK_ENABLE();
+    __HAL_RCC_SYSCFG_CLK_ENABLE();
+    HAL_SYSCFG_DMA_Req(DMA_CHANNEL_MAP_TIM1_UP << SYSCFG_CFGR3_DMA2_MAP_Pos);
+    checkOk(HAL_DMA_Init(&hdma2));
+    checkOk(HAL_DMA_Start(&hdma2, (uint32_t) pattern, (uint32_t) &htim1.Instance->CCR4, length));
+    __HAL_TIM_ENABLE_DMA(&htim1, TIM_DMA_UPDATE);
+}
+#endif
+
+// uses LSI clock, 32.768kHz / 128 = 256Hz
+LPTIM_HandleTypeDef hlptim = {
+    .Instance = LPTIM,
+    .Init = {
+        .Prescaler = LPTIM_PRESCALER_DIV128,
+        .UpdateMode = LPTIM_UPDATE_IMMEDIATE,
+    },
+};
+
+void APP_LptimConfig(void) {
+    __HAL_RCC_LPTIM_CLK_ENABLE();
+    checkOk(HAL_RCCEx_PeriphCLKConfig(&(RCC_PeriphCLKInitTypeDef){
+        .PeriphClockSelection = RCC_PERIPHCLK_LPTIM,
+        .LptimClockSelection = RCC_LPTIMCLKSOURCE_LSI,
+    }));
+    checkOk(HAL_LPTIM_Init(&hlptim));
+    // the LPTIM wakes the core from STOP through EXTI line 29
+    SET_BIT(EXTI->IMR, EXTI_IMR_IM29);
+    HAL_NVIC_SetPriority(LPTIM1_IRQn, PRIORITY_HIGH, 0);
+    HAL_NVIC_EnableIRQ(LPTIM1_IRQn);
+}
+
+void startLptimOnce(uint32_t ms) {
+    checkOk(HAL_LPTIM_SetOnce_Start_IT(&hlptim, ms * (LSI_VALUE / 128) / 1000));
+}
+
+void enterStopMode(void) {
+    HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+}
+
+void stopLptim(void) {
+    checkOk(HAL_LPTIM_SetOnce_Stop_IT(&hlptim));
+}
+
+void APP_TachOutputConfig(void) {
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    HAL_GPIO_Init(GPIOA, &(GPIO_InitTypeDef){.Mode = GPIO_MODE_ANALOG, .Pull = GPIO_NOPULL, .Pin = GPIO_PIN_14});
+    HAL_GPIO_Init(
+        GPIOB,
+        &(GPIO_InitTypeDef){
+            .Mode = GPIO_MODE_AF_OD,
+            .Pull = GPIO_NOPULL,
+            .Speed = GPIO_SPEED_FREQ_LOW,
+            .Pin = GPIO_PIN_3,
+            .Alternate = GPIO_AF1_TIM1,
+        });
+    // released, also while OVERCURRENT_LIMIT has MOE cleared
+    checkOk(HAL_TIM_OC_ConfigChannel(
+        &htim1,
+        &(TIM_OC_InitTypeDef){
+            .OCMode = TIM_OCMODE_FORCED_ACTIVE,
+            .OCPolarity = TIM_OCPOLARITY_HIGH,
+            .OCNPolarity = TIM_OCNPOLARITY_LOW,
+            .OCIdleState = TIM_OCIDLESTATE_SET,
+            .OCNIdleState = TIM_OCNIDLESTATE_RESET,
+            .Pulse = 0,
+        },
+        TIM_CHANNEL_2));
+    TIM_CCxChannelCmd(htim1.Instance, TIM_CHANNEL_2, TIM_CCx_ENABLE);
+    HAL_NVIC_SetPriority(SysTick_IRQn, PRIORITY_LOW, 0);
+}
+#endif
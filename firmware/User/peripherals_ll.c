@@ -0,0 +1,369 @@
+#ifdef USE_FULL_LL_DRIVER
+#include "logic.h"
+#include "peripherals.h"
+#include "py32f0xx_ll_adc.h"
+#include "py32f0xx_ll_bus.h"
+#include "py32f0xx_ll_cortex.h"
+#include "py32f0xx_ll_dma.h"
+#include "py32f0xx_ll_exti.h"
+#include "py32f0xx_ll_gpio.h"
+#include "py32f0xx_ll_iwdg.h"
+#include "py32f0xx_ll_lptim.h"
+#include "py32f0xx_ll_pwr.h"
+#include "py32f0xx_ll_rcc.h"
+#include "py32f0xx_ll_system.h"
+#include "py32f0xx_ll_tim.h"
+#include "py32f0xx_ll_utils.h"
+
+/** Starts counting milliseconds, once SystemCoreClock is set */
+static void APP_TickConfig(void) {
+    LL_APB1_GRP2_EnableClock(LL_APB1_GRP2_PERIPH_TIM16);
+    checkOk(LL_TIM_Init(TIM16, &(LL_TIM_InitTypeDef){
+                                   .Prescaler = SystemCoreClock / 1000 - 1,
+                                   .CounterMode = LL_TIM_COUNTERMODE_UP,
+                                   .Autoreload = 0xffff,
+                                   .ClockDivision = LL_TIM_CLOCKDIVISION_DIV1,
+                                   .RepetitionCounter = 0,
+                               }));
+    LL_TIM_ClearFlag_UPDATE(TIM16);
+    NVIC_SetPriority(TIM16_IRQn, PRIORITY_LOWEST);
+    NVIC_EnableIRQ(TIM16_IRQn);
+    LL_TIM_EnableIT_UPDATE(TIM16);
+    LL_TIM_EnableCounter(TIM16);
+}
+
+void APP_SystemClockConfig(void) {
+    // internal oscillator, 24MHz / 2 = 12MHz
+    LL_RCC_HSI_Enable();
+    LL_RCC_HSI_SetCalibFreq(LL_RCC_HSICALIBRATION_24MHz);
+    LL_RCC_SetHSIDiv(LL_RCC_HSI_DIV_2);
+    while (!LL_RCC_HSI_IsReady()) {}
+    // make sure we have a LSI for the watchdog
+    LL_RCC_LSI_Enable();
+    while (!LL_RCC_LSI_IsReady()) {}
+
+    LL_RCC_SetAHBPrescaler(LL_RCC_SYSCLK_DIV_1);
+    LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_HSISYS);
+    while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_HSISYS) {}
+    LL_FLASH_SetLatency(LL_FLASH_LATENCY_0);// latency 0 for <= 24MHz
+    LL_RCC_SetAPB1Prescaler(LL_RCC_APB1_DIV_1);
+    LL_SetSystemCoreClock(SYSCLOCK_FREQ_HZ);
+    APP_TickConfig();
+}
+
+// uses LSI clock, 32kHz
+void APP_Watchdog(void) {
+    LL_IWDG_Enable(IWDG);
+    LL_IWDG_EnableWriteAccess(IWDG);
+    LL_IWDG_SetPrescaler(IWDG, LL_IWDG_PRESCALER_256);
+    LL_IWDG_SetReloadCounter(IWDG, 125);// 1s
+    while (!LL_IWDG_IsReady(IWDG)) {}
+    LL_IWDG_ReloadCounter(IWDG);
+}
+
+void refreshWatchdog(void) {
+    LL_IWDG_ReloadCounter(IWDG);
+}
+
+void APP_AdcConfig(uint32_t overTempCounts) {
+    LL_APB1_GRP2_ForceReset(LL_APB1_GRP2_PERIPH_ADC1);
+    LL_APB1_GRP2_ReleaseReset(LL_APB1_GRP2_PERIPH_ADC1);
+    LL_APB1_GRP2_EnableClock(LL_APB1_GRP2_PERIPH_ADC1);
+
+    // PA3 is TEMP_SENSE, PA4 is FAN_SENSE
+    checkOk(LL_GPIO_Init(GPIOA, &(LL_GPIO_InitTypeDef){
+                                    .Mode = LL_GPIO_MODE_ANALOG,
+                                    .Pin = LL_GPIO_PIN_3 | LL_GPIO_PIN_4,
+                                }));
+
+    LL_ADC_StartCalibration(ADC1);
+    while (LL_ADC_IsCalibrationOnGoing(ADC1)) {}
+    checkOk(LL_ADC_Init(ADC1, &(LL_ADC_InitTypeDef){
+                                  .Clock = LL_ADC_CLOCK_SYNC_PCLK_DIV4,
+                                  .Resolution = LL_ADC_RESOLUTION_12B,
+                                  .DataAlignment = LL_ADC_DATA_ALIGN_RIGHT,
+                                  .LowPowerMode = LL_ADC_LP_MODE_NONE,
+                              }));
+    // the same settings as hadc1 in the HAL build
+    checkOk(LL_ADC_REG_Init(ADC1, &(LL_ADC_REG_InitTypeDef){
+#ifdef ADC_PWM_SYNC
+                                      .TriggerSource = LL_ADC_REG_TRIG_EXT_TIM1_TRGO,
+                                      .SequencerDiscont = LL_ADC_REG_SEQ_DISCONT_1RANK,
+                                      .ContinuousMode = LL_ADC_REG_CONV_SINGLE,
+#else
+                                      .TriggerSource = LL_ADC_REG_TRIG_SOFTWARE,
+                                      .SequencerDiscont = LL_ADC_REG_SEQ_DISCONT_DISABLE,
+                                      .ContinuousMode = LL_ADC_REG_CONV_CONTINUOUS,
+#endif
+#if defined(DMA1)
+                                      .DMATransfer = LL_ADC_REG_DMA_TRANSFER_UNLIMITED,
+#endif
+                                      .Overrun = LL_ADC_REG_OVR_DATA_OVERWRITTEN,
+                                  }));
+    LL_ADC_REG_SetSequencerScanDirection(ADC1, LL_ADC_REG_SEQ_SCAN_DIR_FORWARD);
+#ifdef ADC_PWM_SYNC
+    LL_ADC_SetSamplingTimeCommonChannels(ADC1, LL_ADC_SAMPLINGTIME_41CYCLES_5);
+#else
+    LL_ADC_SetSamplingTimeCommonChannels(ADC1, LL_ADC_SAMPLINGTIME_239CYCLES_5);
+#endif
+    LL_ADC_REG_SetSequencerChannels(ADC1, LL_ADC_CHANNEL_3 | LL_ADC_CHANNEL_4);
+
+    LL_ADC_SetAnalogWDMonitChannels(ADC1, LL_ADC_AWD_CHANNEL_3_REG);
+    LL_ADC_ConfigAnalogWDThresholds(ADC1, overTempCounts - 1, 0);
+    LL_ADC_ClearFlag_AWD(ADC1);
+    LL_ADC_EnableIT_AWD(ADC1);
+    NVIC_SetPriority(ADC_COMP_IRQn, PRIORITY_HIGH);
+    NVIC_EnableIRQ(ADC_COMP_IRQn);
+#if !defined(DMA1)
+    LL_ADC_EnableIT_EOC(ADC1);
+#endif
+}
+
+#if defined(DMA1)
+/** Conversions in the DMA's circle, for startAdcConversions */
+static uint32_t adcDmaLength;
+
+void APP_AdcDmaConfig(uint16_t *samples, uint32_t length) {
+    adcDmaLength = length;
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+    LL_APB1_GRP2_EnableClock(LL_APB1_GRP2_PERIPH_SYSCFG);
+    LL_SYSCFG_SetDMARemap_CH1(LL_SYSCFG_DMA_MAP_ADC);
+    LL_DMA_ConfigTransfer(DMA1, LL_DMA_CHANNEL_1,
+                          LL_DMA_DIRECTION_PERIPH_TO_MEMORY | LL_DMA_MODE_CIRCULAR | LL_DMA_PERIPH_NOINCREMENT |
+                              LL_DMA_MEMORY_INCREMENT | LL_DMA_PDATAALIGN_WORD | LL_DMA_MDATAALIGN_HALFWORD |
+                              LL_DMA_PRIORITY_HIGH);
+    LL_DMA_ConfigAddresses(DMA1, LL_DMA_CHANNEL_1, LL_ADC_DMA_GetRegAddr(ADC1, LL_ADC_DMA_REG_REGULAR_DATA),
+                           (uint32_t) samples, LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_EnableIT_HT(DMA1, LL_DMA_CHANNEL_1);
+    LL_DMA_EnableIT_TC(DMA1, LL_DMA_CHANNEL_1);
+    NVIC_SetPriority(DMA1_Channel1_IRQn, PRIORITY_HIGH);
+    NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+}
+#endif
+
+void startAdcConversions(void) {
+#if defined(DMA1)
+    LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_1, adcDmaLength);
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_1);
+#endif
+    LL_ADC_Enable(ADC1);
+    // the ADC needs 1us to stabilize after it's enabled, see HAL's ADC_STAB_DELAY_US
+    for (volatile uint32_t wait = SYSCLOCK_FREQ_HZ / 1000000; wait != 0; wait--) {}
+    LL_ADC_ClearFlag_EOC(ADC1);
+    LL_ADC_ClearFlag_EOS(ADC1);
+    LL_ADC_ClearFlag_OVR(ADC1);
+    LL_ADC_REG_StartConversion(ADC1);
+}
+
+void stopAdcConversions(void) {
+    LL_ADC_REG_StopConversion(ADC1);
+    while (LL_ADC_REG_IsConversionOngoing(ADC1)) {}
+    checkOk(LL_ADC_Disable(ADC1));
+#if defined(DMA1)
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_1);
+#endif
+}
+
+#ifdef CLOCK_SCALING
+/** HSI dividers & ADC clock prescalers, for each clockShift */
+static const uint32_t HSI_DIVIDERS[] = {LL_RCC_HSI_DIV_2, LL_RCC_HSI_DIV_4, LL_RCC_HSI_DIV_8};
+static const uint32_t ADC_CLOCKS[] = {LL_ADC_CLOCK_SYNC_PCLK_DIV4, LL_ADC_CLOCK_SYNC_PCLK_DIV2,
+                                      LL_ADC_CLOCK_SYNC_PCLK_DIV1};
+
+void setClockDividers(uint32_t shift) {
+    LL_RCC_SetHSIDiv(HSI_DIVIDERS[shift]);
+    LL_ADC_SetClock(ADC1, ADC_CLOCKS[shift]);
+}
+#endif
+
+void APP_PwmOutConfig(uint32_t updatePeriods) {
+    LL_APB1_GRP2_EnableClock(LL_APB1_GRP2_PERIPH_TIM1);
+    LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOA);
+
+    // PWM output 200kHz
+    // Pin 7, PA1, TIM1_CH4
+    checkOk(LL_GPIO_Init(GPIOA, &(LL_GPIO_InitTypeDef){
+                                    .Mode = LL_GPIO_MODE_ALTERNATE,
+                                    .Pull = LL_GPIO_PULL_UP,
+                                    .Speed = LL_GPIO_SPEED_FREQ_HIGH,
+                                    .OutputType = LL_GPIO_OUTPUT_PUSHPULL,
+                                    .Pin = LL_GPIO_PIN_1,
+                                    .Alternate = LL_GPIO_AF_13,
+                                }));
+
+    checkOk(LL_TIM_Init(TIM1, &(LL_TIM_InitTypeDef){
+                                  .Prescaler = 0,
+                                  .CounterMode = LL_TIM_COUNTERMODE_UP,
+                                  .Autoreload = PWM_PERIOD,
+                                  .ClockDivision = LL_TIM_CLOCKDIVISION_DIV1,
+                                  .RepetitionCounter = updatePeriods - 1,
+                              }));
+    // the period only changes at an update event, like the duty cycle
+    LL_TIM_EnableARRPreload(TIM1);
+    checkOk(LL_TIM_OC_Init(TIM1, LL_TIM_CHANNEL_CH4, &(LL_TIM_OC_InitTypeDef){
+                                                         .OCMode = LL_TIM_OCMODE_PWM1,
+                                                         .OCState = LL_TIM_OCSTATE_ENABLE,
+                                                         .OCNState = LL_TIM_OCSTATE_DISABLE,
+                                                         .CompareValue = 0,// duty cycle = 0%
+                                                         .OCPolarity = LL_TIM_OCPOLARITY_HIGH,
+                                                         .OCNPolarity = LL_TIM_OCPOLARITY_LOW,
+                                                         .OCIdleState = LL_TIM_OCIDLESTATE_LOW,
+                                                         .OCNIdleState = LL_TIM_OCIDLESTATE_LOW,
+                                                     }));
+    // like HAL_TIM_PWM_ConfigChannel, new duty cycles take effect at the next period
+    LL_TIM_OC_EnablePreload(TIM1, LL_TIM_CHANNEL_CH4);
+#ifdef ADC_PWM_SYNC
+    // channel 1 isn't connected to a pin, it only sends a pulse on TRGO to start the ADC
+    checkOk(LL_TIM_OC_Init(TIM1, LL_TIM_CHANNEL_CH1, &(LL_TIM_OC_InitTypeDef){
+                                                         .OCMode = LL_TIM_OCMODE_FROZEN,
+                                                         .OCState = LL_TIM_OCSTATE_ENABLE,
+                                                         .CompareValue = 0,
+                                                     }));
+    LL_TIM_SetTriggerOutput(TIM1, LL_TIM_TRGO_CC1IF);
+#endif
+#ifdef OVERCURRENT_LIMIT
+    // a break clears MOE, which forces PA1 to its idle state, low, until the control loop sets it again
+    checkOk(LL_TIM_BDTR_Init(TIM1, &(LL_TIM_BDTR_InitTypeDef){
+                                       .OSSRState = LL_TIM_OSSR_DISABLE,
+                                       .OSSIState = LL_TIM_OSSI_ENABLE,
+                                       .LockLevel = LL_TIM_LOCKLEVEL_OFF,
+                                       .DeadTime = 0,
+                                       .BreakState = LL_TIM_BREAK_ENABLE,
+                                       .BreakPolarity = LL_TIM_BREAK_POLARITY_HIGH,
+                                       .AutomaticOutput = LL_TIM_AUTOMATICOUTPUT_DISABLE,
+                                   }));
+#endif
+    LL_TIM_EnableAllOutputs(TIM1);
+    LL_TIM_EnableCounter(TIM1);
+}
+
+void APP_TachConfig(void) {
+    LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOA | LL_IOP_GRP1_PERIPH_GPIOB);
+    LL_GPIO_SetPinMode(GPIOA, LL_GPIO_PIN_14, LL_GPIO_MODE_ANALOG);
+    // the tach is open collector
+    checkOk(LL_GPIO_Init(GPIOB, &(LL_GPIO_InitTypeDef){
+                                    .Mode = LL_GPIO_MODE_ALTERNATE,
+                                    .Pull = LL_GPIO_PULL_UP,
+                                    .Speed = LL_GPIO_SPEED_FREQ_LOW,
+                                    .OutputType = LL_GPIO_OUTPUT_PUSHPULL,
+                                    .Pin = LL_GPIO_PIN_3,
+                                    .Alternate = LL_GPIO_AF_1,
+                                }));
+    checkOk(LL_TIM_IC_Init(TIM1, LL_TIM_CHANNEL_CH2, &(LL_TIM_IC_InitTypeDef){
+                                                         .ICPolarity = LL_TIM_IC_POLARITY_FALLING,
+                                                         .ICActiveInput = LL_TIM_ACTIVEINPUT_DIRECTTI,
+                                                         .ICPrescaler = LL_TIM_ICPSC_DIV1,
+                                                         .ICFilter = LL_TIM_IC_FILTER_FDIV1_N8,
+                                                     }));
+    LL_TIM_CC_EnableChannel(TIM1, LL_TIM_CHANNEL_CH2);
+    NVIC_SetPriority(TIM1_CC_IRQn, PRIORITY_HIGH);
+    NVIC_EnableIRQ(TIM1_CC_IRQn);
+    LL_TIM_EnableIT_CC2(TIM1);
+}
+
+void APP_PwmInputConfig(uint32_t period) {
+    LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOA | LL_IOP_GRP1_PERIPH_GPIOB);
+    LL_GPIO_SetPinMode(GPIOA, LL_GPIO_PIN_14, LL_GPIO_MODE_ANALOG);
+    // the host's output is open drain, and the fan runs at full speed if it's not connected
+    checkOk(LL_GPIO_Init(GPIOB, &(LL_GPIO_InitTypeDef){
+                                    .Mode = LL_GPIO_MODE_ALTERNATE,
+                                    .Pull = LL_GPIO_PULL_UP,
+                                    .Speed = LL_GPIO_SPEED_FREQ_LOW,
+                                    .OutputType = LL_GPIO_OUTPUT_PUSHPULL,
+                                    .Pin = LL_GPIO_PIN_3,
+                                    .Alternate = LL_GPIO_AF_1,
+                                }));
+    checkOk(LL_TIM_IC_Init(TIM1, LL_TIM_CHANNEL_CH2, &(LL_TIM_IC_InitTypeDef){
+                                                         .ICPolarity = LL_TIM_IC_POLARITY_RISING,
+                                                         .ICActiveInput = LL_TIM_ACTIVEINPUT_DIRECTTI,
+                                                         .ICPrescaler = LL_TIM_ICPSC_DIV1,
+                                                         .ICFilter = LL_TIM_IC_FILTER_FDIV1_N8,
+                                                     }));
+    checkOk(LL_TIM_IC_Init(TIM1, LL_TIM_CHANNEL_CH1, &(LL_TIM_IC_InitTypeDef){
+                                                         .ICPolarity = LL_TIM_IC_POLARITY_FALLING,
+                                                         .ICActiveInput = LL_TIM_ACTIVEINPUT_INDIRECTTI,
+                                                         .ICPrescaler = LL_TIM_ICPSC_DIV1,
+                                                         .ICFilter = LL_TIM_IC_FILTER_FDIV1_N8,
+                                                     }));
+    LL_TIM_SetTriggerInput(TIM1, LL_TIM_TS_TI2FP2);
+    LL_TIM_SetSlaveMode(TIM1, LL_TIM_SLAVEMODE_RESET);
+    LL_TIM_CC_EnableChannel(TIM1, LL_TIM_CHANNEL_CH1 | LL_TIM_CHANNEL_CH2);
+    LL_TIM_SetAutoReload(TIM1, period);
+}
+
+#if defined(DMA1)
+void APP_PwmDitherConfig(const uint16_t *pattern, uint32_t length) {
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+    LL_APB1_GRP2_EnableClock(LL_APB1_GRP2_PERIPH_SYSCFG);
+    LL_SYSCFG_SetDMARemap_CH2(LL_SYSCFG_DMA_MAP_TIM1_UP);
+    LL_DMA_ConfigTransfer(DMA1, LL_DMA_CHANNEL_2,
+                          LL_DMA_DIRECTION_MEMORY_TO_PERIPH | LL_DMA_MODE_CIRCULAR | LL_DMA_PERIPH_NOINCREMENT |
+                              LL_DMA_MEMORY_INCREMENT | LL_DMA_PDATAALIGN_WORD | LL_DMA_MDATAALIGN_HALFWORD |
+                              LL_DMA_PRIORITY_LOW);
+    LL_DMA_ConfigAddresses(DMA1, LL_DMA_CHANNEL_2, (uint32_t) pattern, (uint32_t) &TIM1->CCR4,
+                           LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+    LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_2, length);
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_2);
+    LL_TIM_EnableDMAReq_UPDATE(TIM1);
+}
+#endif
+
+void APP_LptimConfig(void) {
+    LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_LPTIM1 | LL_APB1_GRP1_PERIPH_PWR);
+    // uses LSI clock, 32.768kHz / 128 = 256Hz
+    LL_RCC_SetLPTIMClockSource(LL_RCC_LPTIM1_CLKSOURCE_LSI);
+    checkOk(LL_LPTIM_Init(LPTIM, &(LL_LPTIM_InitTypeDef){
+                                     .Prescaler = LL_LPTIM_PRESCALER_DIV128,
+                                     .UpdateMode = LL_LPTIM_UPDATE_MODE_IMMEDIATE,
+                                 }));
+    // the LPTIM wakes the core from STOP through EXTI line 29
+    LL_EXTI_EnableIT(LL_EXTI_LINE_29);
+    NVIC_SetPriority(LPTIM1_IRQn, PRIORITY_HIGH);
+    NVIC_EnableIRQ(LPTIM1_IRQn);
+}
+
+void startLptimOnce(uint32_t ms) {
+    LL_LPTIM_EnableIT_ARRM(LPTIM);
+    LL_LPTIM_Enable(LPTIM);
+    LL_LPTIM_SetAutoReload(LPTIM, ms * (LSI_VALUE / 128) / 1000);
+    LL_LPTIM_StartCounter(LPTIM, LL_LPTIM_OPERATING_MODE_ONESHOT);
+}
+
+void enterStopMode(void) {
+    // LPR is the low-power regulator in STOP mode too, like HAL_PWR_EnterSTOPMode sets it
+    LL_PWR_EnableLowPowerRunMode();
+    LL_LPM_EnableDeepSleep();
+    __WFI();
+    LL_LPM_EnableSleep();
+}
+
+void stopLptim(void) {
+    LL_LPTIM_Disable(LPTIM);
+    LL_LPTIM_DisableIT_ARRM(LPTIM);
+}
+
+void APP_TachOutputConfig(void) {
+    LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOA | LL_IOP_GRP1_PERIPH_GPIOB);
+    LL_GPIO_SetPinMode(GPIOA, LL_GPIO_PIN_14, LL_GPIO_MODE_ANALOG);
+    checkOk(LL_GPIO_Init(GPIOB, &(LL_GPIO_InitTypeDef){
+                                    .Mode = LL_GPIO_MODE_ALTERNATE,
+                                    .Pull = LL_GPIO_PULL_NO,
+                                    .Speed = LL_GPIO_SPEED_FREQ_LOW,
+                                    .OutputType = LL_GPIO_OUTPUT_OPENDRAIN,
+                                    .Pin = LL_GPIO_PIN_3,
+                                    .Alternate = LL_GPIO_AF_1,
+                                }));
+    // released, also while OVERCURRENT_LIMIT has MOE cleared
+    checkOk(LL_TIM_OC_Init(TIM1, LL_TIM_CHANNEL_CH2, &(LL_TIM_OC_InitTypeDef){
+                                                         .OCMode = LL_TIM_OCMODE_FORCED_ACTIVE,
+                                                         .OCState = LL_TIM_OCSTATE_ENABLE,
+                                                         .OCNState = LL_TIM_OCSTATE_DISABLE,
+                                                         .CompareValue = 0,
+                                                         .OCPolarity = LL_TIM_OCPOLARITY_HIGH,
+                                                         .OCNPolarity = LL_TIM_OCPOLARITY_LOW,
+                                                         .OCIdleState = LL_TIM_OCIDLESTATE_HIGH,
+                                                         .OCNIdleState = LL_TIM_OCIDLESTATE_LOW,
+                                                     }));
+    NVIC_SetPriority(SysTick_IRQn, PRIORITY_LOW);
+}
+#endif
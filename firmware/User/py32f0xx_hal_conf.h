@@ -44,13 +44,16 @@ extern "C" {
 #define HAL_GPIO_MODULE_ENABLED
 #define HAL_IWDG_MODULE_ENABLED
 #define HAL_TIM_MODULE_ENABLED
-//#define HAL_LPTIM_MODULE_ENABLED
+#define HAL_LPTIM_MODULE_ENABLED
 #define HAL_PWR_MODULE_ENABLED
 //#define HAL_I2C_MODULE_ENABLED
 //#define HAL_UART_MODULE_ENABLED
 //#define HAL_SPI_MODULE_ENABLED
 //#define HAL_EXTI_MODULE_ENABLED
 #define HAL_CORTEX_MODULE_ENABLED
+#if defined(DMA1)
+#define HAL_DMA_MODULE_ENABLED
+#endif
 
 /* ########################## Oscillator Values adaptation ####################*/
 
@@ -139,6 +142,10 @@ extern "C" {
 #include "py32f0xx_hal_cortex.h"
 #endif /* HAL_CORTEX_MODULE_ENABLED */
 
+#ifdef HAL_DMA_MODULE_ENABLED
+#include "py32f0xx_hal_dma.h"
+#endif /* HAL_DMA_MODULE_ENABLED */
+
 #ifdef HAL_ADC_MODULE_ENABLED
 #include "py32f0xx_hal_adc.h"
 #endif /* HAL_ADC_MODULE_ENABLED */
@@ -0,0 +1,108 @@
+#include "rpm_estimate.h"
+
+/** Fractional bits of the Goertzel coefficients */
+#define RPM_COEFFICIENT_BITS 14
+
+#define RPM_COEFFICIENT(bin) \
+    ((int32_t) (2.0 * __builtin_cos(2.0 * 3.14159265358979323846 * (bin) / RPM_WINDOW) * (1 << RPM_COEFFICIENT_BITS) + 0.5))
+
+/** 2 cos(2 pi bin / RPM_WINDOW) for bins 1 .. RPM_BINS */
+static const int32_t RPM_COEFFICIENTS[RPM_BINS] = {
+    RPM_COEFFICIENT(1),  RPM_COEFFICIENT(2),  RPM_COEFFICIENT(3),  RPM_COEFFICIENT(4),
+    RPM_COEFFICIENT(5),  RPM_COEFFICIENT(6),  RPM_COEFFICIENT(7),  RPM_COEFFICIENT(8),
+    RPM_COEFFICIENT(9),  RPM_COEFFICIENT(10), RPM_COEFFICIENT(11), RPM_COEFFICIENT(12),
+    RPM_COEFFICIENT(13), RPM_COEFFICIENT(14), RPM_COEFFICIENT(15), RPM_COEFFICIENT(16),
+};
+
+/** Fractional bits of the window */
+#define RPM_HANN_BITS 14
+
+#define RPM_HANN(i) \
+    ((int16_t) ((0.5 - 0.5 * __builtin_cos(2.0 * 3.14159265358979323846 * (i) / RPM_WINDOW)) * (1 << RPM_HANN_BITS) + 0.5))
+
+/** The first half of a Hann window, which is symmetric about RPM_WINDOW / 2 */
+static const int16_t RPM_HANN_WINDOW[RPM_WINDOW / 2 + 1] = {
+    RPM_HANN(0),  RPM_HANN(1),  RPM_HANN(2),  RPM_HANN(3),  RPM_HANN(4),  RPM_HANN(5),  RPM_HANN(6),
+    RPM_HANN(7),  RPM_HANN(8),  RPM_HANN(9),  RPM_HANN(10), RPM_HANN(11), RPM_HANN(12), RPM_HANN(13),
+    RPM_HANN(14), RPM_HANN(15), RPM_HANN(16), RPM_HANN(17), RPM_HANN(18), RPM_HANN(19), RPM_HANN(20),
+    RPM_HANN(21), RPM_HANN(22), RPM_HANN(23), RPM_HANN(24), RPM_HANN(25), RPM_HANN(26), RPM_HANN(27),
+    RPM_HANN(28), RPM_HANN(29), RPM_HANN(30), RPM_HANN(31), RPM_HANN(32),
+};
+
+/**
+ * coefficient * state, without a 64-bit multiply: the state grows past 2**17 at the low bins, so
+ * split it into the part above RPM_COEFFICIENT_BITS and the part below
+ */
+static int32_t multiplyCoefficient(int32_t coefficient, int32_t state) {
+    int32_t high = state >> RPM_COEFFICIENT_BITS;
+    int32_t low = state & ((1 << RPM_COEFFICIENT_BITS) - 1);
+    return coefficient * high + ((coefficient * low) >> RPM_COEFFICIENT_BITS);
+}
+
+static uint32_t isqrt64(uint64_t x) {
+    uint64_t result = 0;
+    for (uint64_t bit = (uint64_t) 1 << 62; bit != 0; bit >>= 2) {
+        if (x >= result + bit) {
+            x -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+    }
+    return (uint32_t) result;
+}
+
+uint32_t estimateRpm(const uint16_t *samples, uint32_t sampleRateHz) {
+    uint32_t sum = 0;
+    for (int i = 0; i < RPM_WINDOW; i++) { sum += samples[i]; }
+    int32_t mean = (int32_t) (sum >> RPM_WINDOW_BITS);
+
+    // half scale, so that the windowed samples fit 16 bits
+    int16_t windowed[RPM_WINDOW];
+    for (int i = 0; i < RPM_WINDOW; i++) {
+        int32_t hann = RPM_HANN_WINDOW[i < RPM_WINDOW / 2 ? i : RPM_WINDOW - i];
+        windowed[i] = (int16_t) (((int32_t) samples[i] - mean) * hann >> (RPM_HANN_BITS + 1));
+    }
+
+    uint64_t totalPower = 0;
+    uint64_t previousPower = 0;
+    uint64_t peakPower = 0;
+    uint64_t belowPower = 0;
+    uint64_t abovePower = 0;
+    int peak = 0;
+    for (int bin = 1; bin <= RPM_BINS; bin++) {
+        int32_t coefficient = RPM_COEFFICIENTS[bin - 1];
+        int32_t state1 = 0;
+        int32_t state2 = 0;
+        for (int i = 0; i < RPM_WINDOW; i++) {
+            int32_t state0 = windowed[i] + multiplyCoefficient(coefficient, state1) - state2;
+            state2 = state1;
+            state1 = state0;
+        }
+        int64_t signedPower = (int64_t) state1 * state1 + (int64_t) state2 * state2 -
+                              (((int64_t) state1 * state2) >> RPM_COEFFICIENT_BITS) * coefficient;
+        uint64_t power = signedPower > 0 ? (uint64_t) signedPower : 0;
+        totalPower += power;
+        if (bin == peak + 1) { abovePower = power; }
+        if (power > peakPower) {
+            peak = bin;
+            peakPower = power;
+            belowPower = previousPower;
+            abovePower = 0;
+        }
+        previousPower = power;
+    }
+    if (peakPower == 0 || peakPower * RPM_BINS < RPM_PEAK_RATIO * totalPower) { return 0; }
+
+    // with a Hann window, a tone a fraction f of a bin above the peak leaves the bin above it with
+    // (1 + f) / (2 - f) of its magnitude
+    int32_t center = (int32_t) isqrt64(peakPower);
+    int32_t below = (int32_t) isqrt64(belowPower);
+    int32_t above = (int32_t) isqrt64(abovePower);
+    int32_t offset256 = above > below ? (int32_t) (((int64_t) (2 * above - center) << 8) / (center + above))
+                                      : -(int32_t) (((int64_t) (2 * below - center) << 8) / (center + below));
+
+    // bins are sampleRateHz / RPM_WINDOW apart
+    int64_t ripple256Hz = ((int64_t) peak * 256 + offset256) * sampleRateHz >> RPM_WINDOW_BITS;
+    return (uint32_t) ((ripple256Hz * 60 / RPM_RIPPLE_PER_REV + 128) >> 8);
+}
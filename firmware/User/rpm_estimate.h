@@ -0,0 +1,39 @@
+#ifndef FIRMWARE_RPM_ESTIMATE_H
+#define FIRMWARE_RPM_ESTIMATE_H
+
+#include "stdint.h"
+
+/**
+ * Sensorless fan speed, from the ripple that the commutation of a brushless fan puts on FAN_SENSE.
+ *
+ * A Hann-windowed block of RPM_WINDOW samples goes through a bank of Goertzel filters, one for each
+ * of the DFT bins 1 .. RPM_BINS, and the strongest one, interpolated against its stronger neighbour,
+ * is the ripple frequency, to within a few % of a bin. The samples should be decimated (summed) down to 1-2kHz first, so that the bins cover
+ * the range of fan speeds: at 1.5kHz, they're 23Hz apart, up to 375Hz, which is 350 - 5600 RPM for a
+ * 4-pole fan.
+ *
+ * It's integer-only, with 32-bit multiplies in the inner loop, so a window costs RPM_BINS *
+ * RPM_WINDOW filter steps, around 20k cycles on the Cortex-M0+ all told. `make Build/bench` times it
+ * on the host.
+ */
+#define RPM_WINDOW_BITS 6
+#define RPM_WINDOW (1 << RPM_WINDOW_BITS)
+#define RPM_BINS 16
+
+/** Ripple periods per revolution, one per commutation, so 4 for the usual 4-pole fan */
+#define RPM_RIPPLE_PER_REV 4
+
+/** The strongest bin has to have this many times the average power of all of them to count */
+#define RPM_PEAK_RATIO 4
+
+/**
+ * Estimates the fan speed from a window of samples
+ *
+ * @param samples RPM_WINDOW decimated FAN_SENSE samples, each up to 16 bits
+ * @param sampleRateHz how many samples per second, after decimation
+ * @return revolutions per minute, or 0 if there's no clear ripple
+ */
+uint32_t estimateRpm(const uint16_t *samples, uint32_t sampleRateHz);
+
+
+#endif//FIRMWARE_RPM_ESTIMATE_H
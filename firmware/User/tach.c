@@ -0,0 +1,55 @@
+#include "tach.h"
+
+void addTachEdge(uint32_t ticks, TachEdges *edges) {
+    uint32_t count = edges->edges;
+    edges->edgeTicks[count % TACH_RING] = ticks & TACH_TICKS_MASK;
+    edges->edges = count + 1;
+}
+
+void captureTachEdge(uint32_t ticks, uint32_t holdoffTicks, TachEdges *edges) {
+    uint32_t quietTicks = (ticks - edges->lastCaptureTicks) & TACH_TICKS_MASK;
+    edges->lastCaptureTicks = ticks;
+    if (quietTicks >= holdoffTicks) { addTachEdge(ticks, edges); }
+}
+
+uint32_t tachRpm(const TachEdges *edges, uint32_t nowMs, uint32_t ticksPerSecond, TachState *state) {
+    uint32_t count = edges->edges;
+    if (count != state->lastEdges) {
+        state->lastEdges = count;
+        state->lastEdgeMs = nowMs;
+    }
+    if (nowMs - state->lastEdgeMs >= TACH_TIMEOUT_MS) {
+        // stopped, so the next period would span the time it was stopped for
+        state->firstEdge = count;
+        return 0;
+    }
+    if (count - state->firstEdge < TACH_PERIODS + 1) { return 0; }
+
+    // newest first, sorted by insertion
+    uint32_t periods[TACH_PERIODS];
+    for (int i = 0; i < TACH_PERIODS; i++) {
+        uint32_t newer = edges->edgeTicks[(count - 1 - i) % TACH_RING];
+        uint32_t older = edges->edgeTicks[(count - 2 - i) % TACH_RING];
+        uint32_t period = (newer - older) & TACH_TICKS_MASK;
+        int j = i;
+        for (; j > 0 && periods[j - 1] > period; j--) { periods[j] = periods[j - 1]; }
+        periods[j] = period;
+    }
+    uint32_t median = periods[TACH_PERIODS / 2];
+    if (median == 0) { return 0; }
+    return ticksPerSecond * 60 / (median * TACH_PULSES_PER_REV);
+}
+
+uint32_t modelRpm(int32_t ratioQ16, const TachModel *model) {
+    if (ratioQ16 <= model->stopRatioQ16) { return 0; }
+    if (ratioQ16 >= 1 << 16) { return model->maxRpm; }
+    return (uint32_t) ((uint64_t) model->maxRpm * (uint32_t) (ratioQ16 - model->stopRatioQ16) /
+                       (uint32_t) ((1 << 16) - model->stopRatioQ16));
+}
+
+uint32_t tachHalfPeriodTicks(uint32_t rpm, uint32_t ticksPerSecond) {
+    if (rpm == 0) { return 0; }
+    // 60s per minute, two toggles per pulse
+    uint32_t ticks = ticksPerSecond * 60 / (2 * TACH_PULSES_PER_REV) / rpm;
+    return ticks < TACH_TICKS_MASK ? ticks : TACH_TICKS_MASK;
+}
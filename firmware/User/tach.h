@@ -0,0 +1,87 @@
+#ifndef FIRMWARE_TACH_H
+#define FIRMWARE_TACH_H
+
+#include "stdint.h"
+
+/**
+ * Fan speed from a tach wire: the capture interrupt timestamps every valid edge into a ring, and the
+ * control loop takes the median of the last TACH_PERIODS periods, so a spurious or missed edge
+ * doesn't move the speed.
+ */
+
+/** Edge timestamps come from the 24-bit SysTick, so periods have to be shorter than its wrap-around */
+#define TACH_TICKS_MASK 0xFFFFFF
+/** Periods that tachRpm takes the median of */
+#define TACH_PERIODS 7
+/** More timestamps than that, so the interrupt can add a few while tachRpm reads */
+#define TACH_RING 16
+/** Tach pulses per revolution, 2 for a standard PC fan */
+#define TACH_PULSES_PER_REV 2
+/** No edge for this long means the fan stopped, so the slowest speed it can see is 60 RPM */
+#define TACH_TIMEOUT_MS 500
+/**
+ * Quiet time before a captured edge counts as a new pulse, see captureTachEdge. Longer than a PWM
+ * period at 10kHz or faster, and shorter than half a tach period up to 30000 RPM.
+ */
+#define TACH_HOLDOFF_US 500
+
+typedef struct {
+    /** Timestamps of the last TACH_RING edges, in SysTick ticks counting up */
+    uint32_t edgeTicks[TACH_RING];
+    /** Edges so far, the next one goes to edgeTicks[edges % TACH_RING] */
+    volatile uint32_t edges;
+    /** The last edge captureTachEdge saw, whether it counted or not */
+    uint32_t lastCaptureTicks;
+} TachEdges;
+
+typedef struct {
+    /** edges, as of the last tachRpm call, and when it last changed */
+    uint32_t lastEdges;
+    uint32_t lastEdgeMs;
+    /** First edge since the fan was last stopped, the period before it doesn't count */
+    uint32_t firstEdge;
+} TachState;
+
+/** Adds an edge to the ring */
+void addTachEdge(uint32_t ticks, TachEdges *edges);
+
+/**
+ * Adds a captured falling edge to the ring, from the capture interrupt, if it's a new tach pulse. The
+ * fan's ground is switched, so while the tach is low, the pin goes high whenever the PWM output is
+ * off, and falls again at every turn-on. Those come every PWM period, so an edge only counts after
+ * holdoffTicks without any. A pulse that starts while the output is off still counts, at the next
+ * turn-on, so it works at any duty cycle that turns the fan at all, to within a PWM period.
+ */
+void captureTachEdge(uint32_t ticks, uint32_t holdoffTicks, TachEdges *edges);
+
+/**
+ * @param nowMs when it's called, for TACH_TIMEOUT_MS
+ * @param ticksPerSecond the SysTick frequency
+ * @return the fan speed, or 0 if it's stopped or there aren't enough edges since it started
+ */
+uint32_t tachRpm(const TachEdges *edges, uint32_t nowMs, uint32_t ticksPerSecond, TachState *state);
+
+/**
+ * What the fan turns at for a voltage ratio, for a tach output without a measurement: a brushless
+ * fan's speed goes roughly with its voltage, from where it stops up to full speed.
+ */
+typedef struct {
+    /** Speed at full voltage */
+    uint32_t maxRpm;
+    /** Voltage ratio, with 16 fractional bits, that it stops turning below */
+    int32_t stopRatioQ16;
+} TachModel;
+
+/** @param ratioQ16 voltage ratio with 16 fractional bits */
+uint32_t modelRpm(int32_t ratioQ16, const TachModel *model);
+
+/**
+ * Ticks per half a tach period at rpm, at TACH_PULSES_PER_REV, which is how often a tach output has to
+ * toggle. Clamped to TACH_TICKS_MASK, as SysTick times the toggles.
+ *
+ * @return 0 if rpm is 0, for holding the output
+ */
+uint32_t tachHalfPeriodTicks(uint32_t rpm, uint32_t ticksPerSecond);
+
+
+#endif//FIRMWARE_TACH_H
@@ -0,0 +1,6 @@
+#include "temp_table.h"
+
+// must match PTC_THERMISTOR_10K_3950 and REFERENCE_OHMS, test_tempTableAccuracy checks that it does
+#define TEMP_TABLE_10K_3950_KNOT(i) TEMP_TABLE_BETA_KNOT(i, 100000, 10000, 25 + 273, 3950)
+
+const TempTable TEMP_TABLE_10K_3950 = TEMP_TABLE(TEMP_TABLE_10K_3950_KNOT);
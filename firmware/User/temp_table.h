@@ -0,0 +1,127 @@
+#ifndef FIRMWARE_TEMP_TABLE_H
+#define FIRMWARE_TEMP_TABLE_H
+
+#include "logic.h"
+#include "stdint.h"
+
+/**
+ * Compile-time table mapping 12-bit ADC counts straight to temperature, so that the firmware
+ * doesn't need log() at runtime.
+ *
+ * With a 100k reference over a 10k thermistor, everything above room temperature is squeezed into
+ * the top few hundred counts, and each count is worth more than a degree at 100 C. So the knots
+ * are not evenly spaced in counts, but in x = 4096 - counts (proportional to the thermistor
+ * resistance): every octave of x gets TEMP_TABLE_STEPS evenly spaced knots, like a tiny floating
+ * point format. Finding the segment is just a few shifts, and readings in between knots are
+ * linearly interpolated.
+ *
+ * Each knot is an int16_t in 1/64 C, so the table costs 2 * TEMP_TABLE_KNOTS bytes of flash:
+ *
+ * | TEMP_TABLE_STEPS | knots | flash (bytes) | max error, 0..100 C | max error, -40..150 C |
+ * |------------------|-------|---------------|---------------------|-----------------------|
+ * | 4                | 45    | 90            | 0.253 C             | 0.567 C               |
+ * | 8                | 81    | 162           | 0.075 C             | 0.098 C               |
+ * | 16               | 145   | 290           | 0.025 C             | 0.030 C               |
+ * | 32               | 257   | 514           | 0.008 C             | 0.010 C               |
+ *
+ * (errors are against the exact Beta equation for PTC_THERMISTOR_10K_3950, measured by
+ * test_tempTableAccuracy; the 1/64 C storage limits the bigger tables)
+ */
+#ifndef TEMP_TABLE_STEPS
+#define TEMP_TABLE_STEPS 8
+#endif
+
+#if TEMP_TABLE_STEPS == 4
+#define TEMP_TABLE_STEP_BITS 2
+#define TEMP_TABLE_GROUPS 11
+#elif TEMP_TABLE_STEPS == 8
+#define TEMP_TABLE_STEP_BITS 3
+#define TEMP_TABLE_GROUPS 10
+#elif TEMP_TABLE_STEPS == 16
+#define TEMP_TABLE_STEP_BITS 4
+#define TEMP_TABLE_GROUPS 9
+#elif TEMP_TABLE_STEPS == 32
+#define TEMP_TABLE_STEP_BITS 5
+#define TEMP_TABLE_GROUPS 8
+#else
+#error "TEMP_TABLE_STEPS must be 4, 8, 16 or 32"
+#endif
+
+/** x = 0 .. 4095 is covered by TEMP_TABLE_GROUPS groups of knots, plus one for x = 4096 */
+#define TEMP_TABLE_KNOTS (TEMP_TABLE_GROUPS * TEMP_TABLE_STEPS + 1)
+
+/** Knots are stored in 1/(2**TEMP_TABLE_FRAC_BITS) C */
+#define TEMP_TABLE_FRAC_BITS 6
+
+typedef int16_t TempTable[TEMP_TABLE_KNOTS];
+
+/**
+ * x = 4096 - counts at knot i. The first group is spaced 1 apart, then every following group
+ * covers the next octave of x.
+ */
+#define TEMP_TABLE_X(i)                                                                  \
+    ((i) < TEMP_TABLE_STEPS ? (i)                                                        \
+                            : (TEMP_TABLE_STEPS + ((i) & (TEMP_TABLE_STEPS - 1)))        \
+                                  << (((i) >> TEMP_TABLE_STEP_BITS) - 1))
+
+/**
+ * ADC counts at knot i. x = 0 can't be measured, so it just repeats x = 1, and like
+ * countsToRatio, x = 4096 uses the smallest allowed ratio (1e-4) instead of 0.
+ */
+#define TEMP_TABLE_COUNTS(i)            \
+    (TEMP_TABLE_X(i) == 0      ? 4095.0 \
+     : TEMP_TABLE_X(i) == 4096 ? 0.4096 \
+                               : (double) (4096 - TEMP_TABLE_X(i)))
+
+/** Beta equation, same as resistanceToTempC (C) */
+#define TEMP_TABLE_TEMP_C(counts, referenceOhms, nominalOhms, nominalTempK, beta)                  \
+    (1.0 / (1.0 / (nominalTempK) +                                                                 \
+            __builtin_log((referenceOhms) * (4096.0 / (counts) - 1.0) / (nominalOhms)) / (beta)) - \
+     KELVIN_OFFSET)
+
+/** Rounds and saturates a temperature (C) to the int16_t knot format */
+#define TEMP_TABLE_KNOT(tempC)                                                  \
+    ((int16_t) ((tempC) * (1 << TEMP_TABLE_FRAC_BITS) >= 32767.0    ? 32767.0  \
+                : (tempC) * (1 << TEMP_TABLE_FRAC_BITS) <= -32768.0 ? -32768.0 \
+                : (tempC) >= 0 ? (tempC) * (1 << TEMP_TABLE_FRAC_BITS) + 0.5    \
+                               : (tempC) * (1 << TEMP_TABLE_FRAC_BITS) - 0.5))
+
+/**
+ * Knot i of a table for a thermistor (see PtcThermistorConfig) in the top half of a divider,
+ * with a referenceOhms resistor on the bottom.
+ */
+#define TEMP_TABLE_BETA_KNOT(i, referenceOhms, nominalOhms, nominalTempK, beta) \
+    TEMP_TABLE_KNOT(TEMP_TABLE_TEMP_C(TEMP_TABLE_COUNTS(i), referenceOhms, nominalOhms, nominalTempK, beta))
+
+#define TEMP_TABLE_REPEAT_1(f, i) f(i),
+#define TEMP_TABLE_REPEAT_2(f, i) TEMP_TABLE_REPEAT_1(f, i) TEMP_TABLE_REPEAT_1(f, (i) + 1)
+#define TEMP_TABLE_REPEAT_4(f, i) TEMP_TABLE_REPEAT_2(f, i) TEMP_TABLE_REPEAT_2(f, (i) + 2)
+#define TEMP_TABLE_REPEAT_8(f, i) TEMP_TABLE_REPEAT_4(f, i) TEMP_TABLE_REPEAT_4(f, (i) + 4)
+#define TEMP_TABLE_REPEAT_16(f, i) TEMP_TABLE_REPEAT_8(f, i) TEMP_TABLE_REPEAT_8(f, (i) + 8)
+#define TEMP_TABLE_REPEAT_32(f, i) TEMP_TABLE_REPEAT_16(f, i) TEMP_TABLE_REPEAT_16(f, (i) + 16)
+#define TEMP_TABLE_REPEAT_(n, f, i) TEMP_TABLE_REPEAT_##n(f, i)
+#define TEMP_TABLE_REPEAT(n, f, i) TEMP_TABLE_REPEAT_(n, f, i)
+
+#define TEMP_TABLE_GROUP(f, g) TEMP_TABLE_REPEAT(TEMP_TABLE_STEPS, f, (g) * TEMP_TABLE_STEPS)
+#define TEMP_TABLE_GROUPS_8(f)                                                                  \
+    TEMP_TABLE_GROUP(f, 0) TEMP_TABLE_GROUP(f, 1) TEMP_TABLE_GROUP(f, 2) TEMP_TABLE_GROUP(f, 3) \
+    TEMP_TABLE_GROUP(f, 4) TEMP_TABLE_GROUP(f, 5) TEMP_TABLE_GROUP(f, 6) TEMP_TABLE_GROUP(f, 7)
+#define TEMP_TABLE_GROUPS_9(f) TEMP_TABLE_GROUPS_8(f) TEMP_TABLE_GROUP(f, 8)
+#define TEMP_TABLE_GROUPS_10(f) TEMP_TABLE_GROUPS_9(f) TEMP_TABLE_GROUP(f, 9)
+#define TEMP_TABLE_GROUPS_11(f) TEMP_TABLE_GROUPS_10(f) TEMP_TABLE_GROUP(f, 10)
+#define TEMP_TABLE_GROUPS_(n, f) TEMP_TABLE_GROUPS_##n(f)
+#define TEMP_TABLE_ALL_GROUPS(n, f) TEMP_TABLE_GROUPS_(n, f)
+
+/**
+ * Expands to the initializer of a TempTable. knotAt(i) must expand to a constant expression for
+ * knot i, usually TEMP_TABLE_BETA_KNOT with literal parameters so that the compiler can fold the
+ * whole table into flash.
+ */
+#define TEMP_TABLE(knotAt) \
+    {TEMP_TABLE_ALL_GROUPS(TEMP_TABLE_GROUPS, knotAt) knotAt(TEMP_TABLE_KNOTS - 1)}
+
+/** PTC_THERMISTOR_10K_3950 below REFERENCE_OHMS */
+extern const TempTable TEMP_TABLE_10K_3950;
+
+
+#endif//FIRMWARE_TEMP_TABLE_H
@@ -63,7 +63,7 @@ endif
 TGT_INCFLAGS := $(addprefix -I $(TOP)/, $(INCLUDES))
 
 
-.PHONY: all clean flash echo
+.PHONY: all clean flash echo size
 
 all: $(BDIR)/$(PROJECT).elf $(BDIR)/$(PROJECT).bin $(BDIR)/$(PROJECT).hex $(BDIR)/$(PROJECT).stripped.elf $(BUILD_DIR)/test
 
@@ -111,6 +111,10 @@ $(BDIR)/$(PROJECT).elf: $(OBJS) $(TOP)/$(LDSCRIPT)
 	@printf "  OBJCP HEX\t$@\n"
 	$(Q)$(OBJCOPY) -I elf32-littlearm -O ihex  $< $@
 
+# Flash & RAM usage, see "Comparing HAL And LL" in README.md
+size: $(BDIR)/$(PROJECT).elf
+	$(Q)$(PREFIX)size $<
+
 clean:
 	rm -rf Build
 	mkdir -p Build
@@ -134,5 +138,8 @@ endif
 format:
 	clang-format -i User/*.c User/*.h
 
-$(BUILD_DIR)/test: Libraries/Unity/unity.c User/logic.c Test/main.c
-	gcc --coverage -DUNITY_INCLUDE_DOUBLE=1 -lm -IUser -ILibraries/Unity $^ -o $@
+$(BUILD_DIR)/test: Libraries/Unity/unity.c User/dither.c User/logic.c User/logic_fixed.c User/temp_table.c User/duty_table.c User/logic_counts.c User/fan_policy.c User/overcurrent.c User/rpm_estimate.c User/tach.c Test/main.c
+	gcc --coverage -DUNITY_INCLUDE_DOUBLE=1 -IUser -ILibraries/Unity $^ -lm -o $@
+
+$(BUILD_DIR)/bench: User/rpm_estimate.c Test/bench.c
+	gcc -O2 -IUser $^ -lm -o $@